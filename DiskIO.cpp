@@ -0,0 +1,170 @@
+#include "DiskIO.h"
+#include "IoUring.h"
+#include <sys/time.h>
+
+// Returns the current time in microseconds
+static unsigned long long now_us()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return 1000000ull*tv.tv_sec + tv.tv_usec;
+}
+
+DiskIO::DiskIO(unsigned threads)
+    : available(&mutex), m_threads(threads), m_depth(0), uring(NULL),
+      m_completed(0), total_latency(0), max_latency(0)
+{
+}
+
+DiskIO::~DiskIO()
+{
+    delete uring;
+}
+
+// Submits jobs to io_uring where possible. Returns false if io_uring is not
+// supported.
+bool DiskIO::enableUring(unsigned entries)
+{
+    if(!uring)
+        uring = IoUring::create(entries);
+    return uring != NULL;
+}
+
+void DiskIO::start()
+{
+    for(unsigned n = 0; n < m_threads; ++n)
+        omni_thread::create(run_thread, this);
+    if(uring)
+        omni_thread::create(run_reaper, this);
+}
+
+void DiskIO::run_thread(void *arg)
+{
+    ((DiskIO*)arg)->run();
+}
+
+void DiskIO::run()
+{
+    while(true)
+    {
+        DiskJob *job;
+        {
+            omni_mutex_lock l(mutex);
+            while(jobs.empty())
+                available.wait();
+            job = jobs.front();
+            jobs.pop_front();
+        }
+        job->run();
+        finish(job);
+    }
+}
+
+void DiskIO::run_reaper(void *arg)
+{
+    ((DiskIO*)arg)->reap();
+}
+
+void DiskIO::reap()
+{
+    std::vector<DiskJob*> done;
+    while(true)
+    {
+        uring->reap(done);
+        for(size_t n = 0; n < done.size(); ++n)
+        {
+            done[n]->finish(done[n]->reads_ok);
+            finish(done[n]);
+        }
+        done.clear();
+    }
+}
+
+// Updates statistics and completes the job
+void DiskIO::finish(DiskJob *job)
+{
+    unsigned long long latency = now_us() - job->submit_time;
+    {
+        omni_mutex_lock l(mutex);
+        --m_depth;
+        ++m_completed;
+        total_latency += latency;
+        if(latency > max_latency)
+            max_latency = latency;
+    }
+    job->complete();
+}
+
+void DiskIO::submit(DiskJob *job)
+{
+    job->submit_time = now_us();
+    {
+        omni_mutex_lock l(mutex);
+        ++m_depth;
+    }
+
+    if(uring)
+    {
+        std::vector<DiskRead> reads;
+        if(job->prepare(reads))
+        {
+            if(reads.empty())
+            {
+                job->finish(true);
+                finish(job);
+                return;
+            }
+            if(uring->submit(job, reads))
+                return;
+
+            // Ring is full; fall back to the threads
+            for(size_t n = 0; n < reads.size(); ++n)
+                reads[n].file->release();
+        }
+    }
+
+    {
+        omni_mutex_lock l(mutex);
+        if(m_threads > 0)
+        {
+            jobs.push_back(job);
+            available.signal();
+            return;
+        }
+    }
+
+    // No disk threads; run job synchronously
+    job->run();
+    finish(job);
+}
+
+// Passes reads submitted to io_uring to the kernel
+void DiskIO::flush()
+{
+    if(uring)
+        uring->flush();
+}
+
+unsigned DiskIO::depth()
+{
+    omni_mutex_lock l(mutex);
+    return m_depth;
+}
+
+unsigned long long DiskIO::completed()
+{
+    omni_mutex_lock l(mutex);
+    return m_completed;
+}
+
+unsigned long long DiskIO::averageLatency()
+{
+    omni_mutex_lock l(mutex);
+    return m_completed ? total_latency/m_completed : 0;
+}
+
+unsigned long long DiskIO::maximumLatency()
+{
+    omni_mutex_lock l(mutex);
+    return max_latency;
+}
@@ -0,0 +1,86 @@
+#ifndef DISKIO_H_INCLUDED
+#define DISKIO_H_INCLUDED
+
+#include "FileCache.h"
+#include <omnithread.h>
+#include <deque>
+#include <vector>
+
+class IoUring;
+
+// A read performed on behalf of a job by an asynchronous I/O engine
+struct DiskRead
+{
+    const DataFile *file;   // released by the engine when done
+    long long offset;
+    char *data;             // NULL to only prefetch the range
+    size_t length;
+};
+
+// A unit of work for the disk I/O threads. run() is called on a disk
+// thread; complete() is called afterwards (on the same thread) and should
+// hand the job back to its owner.
+//
+// Jobs that can be described as a list of reads may implement prepare();
+// an asynchronous engine then performs the reads and calls finish() with
+// the result instead of calling run().
+class DiskJob
+{
+    friend class DiskIO;
+    friend class IoUring;
+
+    unsigned long long submit_time;
+    unsigned reads_pending;
+    bool reads_ok;
+
+public:
+    virtual ~DiskJob() { };
+
+    virtual void run() = 0;
+    virtual void complete() = 0;
+
+    virtual bool prepare(std::vector<DiskRead> &reads) { return false; };
+    virtual void finish(bool ok) { };
+};
+
+// Pool of threads performing blocking disk reads, so that event loops never
+// have to wait for the disk. Without threads, jobs are run synchronously.
+// If enabled and supported by the kernel, reads are submitted to io_uring
+// instead, and completions are reaped by a single thread.
+class DiskIO
+{
+    omni_mutex mutex;
+    omni_condition available;
+    std::deque<DiskJob*> jobs;
+    unsigned m_threads, m_depth;
+    IoUring *uring;
+
+    // Statistics
+    unsigned long long m_completed, total_latency, max_latency;
+
+    static void run_thread(void *arg);
+    static void run_reaper(void *arg);
+    void run();
+    void reap();
+    void finish(DiskJob *job);
+
+public:
+    DiskIO(unsigned threads);
+    ~DiskIO();
+
+    bool enableUring(unsigned entries);
+    void start();
+    void submit(DiskJob *job);
+    void flush();
+
+    // Number of jobs queued or running
+    unsigned depth();
+
+    // Number of jobs completed, and their latency (in microseconds) from
+    // submission until completion
+    unsigned long long completed();
+    unsigned long long averageLatency();
+    unsigned long long maximumLatency();
+};
+
+#endif /* ndef DISKIO_H_INCLUDED */
@@ -0,0 +1,98 @@
+#include "FileCache.h"
+#include "settings.h"
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+DataFile::~DataFile()
+{
+    close(m_fd);
+}
+
+// Reads exactly size bytes at the given offset; returns false on error or
+// if the file is too short.
+bool DataFile::read(long long offset, char *data, size_t size) const
+{
+#ifdef __MINGW32__
+    omni_mutex_lock l(mutex);
+    if(lseek(m_fd, offset, SEEK_SET) != offset)
+        return false;
+#endif
+    while(size > 0)
+    {
+#ifdef __MINGW32__
+        ssize_t bytes = ::read(m_fd, data, size);
+#else
+        ssize_t bytes = pread(m_fd, data, size, offset);
+#endif
+        if(bytes < 0 && errno == EINTR)
+            continue;
+        if(bytes <= 0)
+            return false;
+        data   += bytes;
+        size   -= bytes;
+        offset += bytes;
+    }
+    return true;
+}
+
+FileCache::FileCache(size_t capacity) : m_capacity(capacity)
+{
+}
+
+FileCache::~FileCache()
+{
+    for(EntryMap::iterator i = entries.begin(); i != entries.end(); ++i)
+        i->second.file->release();
+}
+
+FileCache &FileCache::instance()
+{
+    static FileCache cache(cfg_max_open_files);
+    return cache;
+}
+
+// Returns the open file at the given (absolute) path, opening it if it is
+// not cached. The caller must release the result, which is NULL if the file
+// could not be opened.
+const DataFile *FileCache::open(const std::string &path)
+{
+    omni_mutex_lock l(mutex);
+
+    EntryMap::iterator i = entries.find(path);
+    if(i != entries.end())
+    {
+        lru.splice(lru.begin(), lru, i->second.lru);
+        i->second.file->acquire();
+        return i->second.file;
+    }
+
+    int fd = ::open(path.c_str(), O_RDONLY | O_BINARY);
+    if(fd < 0)
+        return NULL;
+    DataFile *file = new DataFile(fd);
+
+    if(m_capacity > 0)
+    {
+        // Evict least recently used files. Files still in use are closed
+        // when their last user releases them.
+        while(entries.size() >= m_capacity)
+        {
+            EntryMap::iterator j = entries.find(lru.back());
+            lru.pop_back();
+            j->second.file->release();
+            entries.erase(j);
+        }
+
+        Entry &entry = entries[path];
+        entry.file = file;
+        entry.lru  = lru.insert(lru.begin(), path);
+        file->acquire();
+    }
+    return file;
+}
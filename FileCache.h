@@ -0,0 +1,55 @@
+#ifndef FILECACHE_H_INCLUDED
+#define FILECACHE_H_INCLUDED
+
+#include "RefCountingObject.h"
+#include <omnithread.h>
+#include <list>
+#include <map>
+#include <string>
+
+// An open data file, shared through the file cache. The file is closed
+// when the last reference is released.
+class DataFile : public RefCountingObject
+{
+    int m_fd;
+#ifdef __MINGW32__
+    mutable omni_mutex mutex;   // serializes seek+read pairs
+#endif
+
+public:
+    DataFile(int fd) : m_fd(fd) { };
+    ~DataFile();
+
+    inline int fd() const { return m_fd; }
+    bool read(long long offset, char *data, size_t size) const;
+};
+
+// Process-wide cache of open data files, with least-recently-used eviction.
+class FileCache
+{
+    struct Entry
+    {
+        DataFile *file;
+        std::list<std::string>::iterator lru;
+    };
+
+    typedef std::map<std::string, Entry> EntryMap;
+
+    omni_mutex mutex;
+    EntryMap entries;
+    std::list<std::string> lru;     // most recently used first
+    size_t m_capacity;
+
+    FileCache(const FileCache &);
+    FileCache &operator=(const FileCache &);
+
+public:
+    FileCache(size_t capacity);
+    ~FileCache();
+
+    static FileCache &instance();
+
+    const DataFile *open(const std::string &path);
+};
+
+#endif /* ndef FILECACHE_H_INCLUDED */
@@ -1,4 +1,8 @@
 #include "HttpRequest.h"
+#include "settings.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
 #include <sstream>
 #ifdef __MINGW32__
 #include <winsock.h>
@@ -8,7 +12,18 @@
 #include <unistd.h>
 #endif
 
-static const int maxRequestSize = 4096;
+// Maximum size of a request (not counting requests that have been handled)
+static const size_t maxRequestSize = 4096;
+
+// Pipelined requests are not handled while this many bytes are queued
+static const size_t maxQueuedOutput = 1<<16;
+
+// Maximum number of bytes written each time the socket becomes writable, so
+// large replies don't hold up other sockets.
+static const size_t maxWriteSize = 1<<20;
+
+// Maximum length of a data file range queued at once
+static const long long maxChunkSize = 1<<30;
 
 int decode_hexdigit(char c)
 {
@@ -61,13 +76,109 @@ QueryVarMap parseQueryString(const std::string query)
     return vars;
 }
 
+// Finds the value of a header field (matching its name case-insensitively)
+bool HttpRequest::header(const std::string &name, std::string &value) const
+{
+    for(size_t n = 0; n < headers.size(); ++n)
+    {
+        const std::string &line = headers[n];
+        if( line.size() <= name.size() || line[name.size()] != ':' ||
+            strncasecmp(line.c_str(), name.c_str(), name.size()) != 0 )
+            continue;
+
+        std::string::size_type pos = line.find_first_not_of(" \t", name.size() + 1);
+        value = (pos == std::string::npos) ? std::string() : line.substr(pos);
+        return true;
+    }
+    return false;
+}
+
+// Returns whether the client wants to keep the connection open after the
+// reply (the default for HTTP/1.1, but not for HTTP/1.0).
+bool HttpRequest::persistent() const
+{
+    std::string connection;
+    if(!header("Connection", connection))
+        return protocol != "HTTP/1.0";
+    if(strcasecmp(connection.c_str(), "close") == 0)
+        return false;
+    return protocol != "HTTP/1.0" ||
+           strcasecmp(connection.c_str(), "keep-alive") == 0;
+}
+
 HttpRequestHandler::HttpRequestHandler(SocketSet &set, int fd)
-    : Socket(set, fd, readable), output_pos(0)
+    : Socket(set, fd, readable), keep_alive(true), requests(0),
+      queued(0), sent(0)
 {
+    setNonBlocking();
+    if(cfg_http_timeout)
+        setTimer(1000ul*cfg_http_timeout);
 }
 
 HttpRequestHandler::~HttpRequestHandler()
 {
+    for(size_t n = 0; n < references.size(); ++n)
+        references[n].second->release();
+}
+
+// Writes the status line and the headers that depend on the connection; the
+// caller adds other headers and the empty line that ends them.
+void HttpRequestHandler::writeHeader( std::ostream &os,
+                                      const char *status, long long length )
+{
+    os << "HTTP/1.1 " << status << "\r\n"
+       << "Content-Length: " << length << "\r\n"
+       << "Connection: " << (keep_alive ? "keep-alive" : "close") << "\r\n";
+}
+
+void HttpRequestHandler::writeReply( std::ostream &os, const char *status,
+                                     const std::string &body )
+{
+    writeHeader(os, status, body.size());
+    os << "Content-Type: text/plain\r\n\r\n" << body;
+}
+
+// Queues the reply written so far, followed by a range of a data file.
+void HttpRequestHandler::sendFile( const MetaInfo *info, unsigned file,
+                                   long long offset, long long length )
+{
+    queueReply();
+    for(long long pos = 0; pos < length; pos += maxChunkSize)
+        output.pushFile(info, file, offset + pos, std::min(length - pos, maxChunkSize));
+    queued += length;
+    info->acquire();
+    references.push_back(std::make_pair(queued, info));
+}
+
+// Queues the reply written so far; if headers_only is set, anything after
+// the headers is left out (as required for replies to HEAD requests).
+void HttpRequestHandler::queueReply(bool headers_only)
+{
+    std::string data = reply.str();
+    std::string::size_type end = data.find("\r\n\r\n");
+    if(headers_only && end != std::string::npos)
+        data.erase(end + 4);
+    if(data.empty())
+        return;
+    output.push(data.data(), data.size());
+    queued += data.size();
+    reply.str(std::string());
+}
+
+// Reads requests while the connection may be reused (and the input buffer
+// has room), and writes while output is queued. Connections waiting for
+// a new request are closed after the idle timeout.
+void HttpRequestHandler::updateMask()
+{
+    int mask = 0;
+    if(keep_alive && input.size() < maxRequestSize)
+        mask |= readable;
+    if(!output.empty())
+        mask |= writable;
+    setMask(mask);
+
+    if(output.empty() && input.empty() && cfg_http_idle_timeout)
+        setTimer(1000ul*cfg_http_idle_timeout);
 }
 
 bool parseRequestLine(HttpRequest &request, std::string line)
@@ -77,6 +188,7 @@ bool parseRequestLine(HttpRequest &request, std::string line)
     iss >> request.method >> uri >> protocol;
     if(protocol.find("HTTP/") != 0)
         return false;
+    request.protocol = protocol;
 
     std::string::size_type sep = uri.find('?');
     if(sep == std::string::npos)
@@ -94,7 +206,14 @@ bool parseRequestLine(HttpRequest &request, std::string line)
 void HttpRequestHandler::onReadable()
 {
     char buffer[2048];
-    ssize_t bytes = read(fd, buffer, sizeof(buffer));
+    ssize_t bytes = read( fd, buffer,
+                          std::min(sizeof(buffer), maxRequestSize - input.size()) );
+
+    if(bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    {
+        // No data available yet
+        return;
+    }
 
     if(bytes <= 0)
     {
@@ -103,19 +222,27 @@ void HttpRequestHandler::onReadable()
         return;
     }
 
-    if(int(input.size()) + bytes > maxRequestSize)
+    input.append(buffer, bytes);
+    if(input.size() >= maxRequestSize && input.find("\r\n\r\n") == std::string::npos)
     {
         // Request size exceeded
         delete this;
         return;
     }
 
-    input.append(buffer, bytes);
-    std::string::size_type end = input.find("\r\n\r\n");
-    if(end != std::string::npos)
+    processInput();
+}
+
+// Handles the complete requests at the start of the input buffer, until the
+// connection is to be closed, or enough output is queued.
+void HttpRequestHandler::processInput()
+{
+    std::string::size_type end;
+    while( keep_alive && output.size() < maxQueuedOutput &&
+           (end = input.find("\r\n\r\n")) != std::string::npos )
     {
         HttpRequest request;
-        bool first = true;
+        bool valid = true, first = true;
         std::string::size_type pos, sep = (std::string::size_type)-2;
         do {
             pos = sep + 2;
@@ -123,56 +250,88 @@ void HttpRequestHandler::onReadable()
             std::string line(input.begin() + pos, input.begin() + sep);
             if(first)
             {
-                if(!parseRequestLine(request, line))
-                {
-                    delete this;
-                    return;
-                }
+                valid = parseRequestLine(request, line);
                 first = false;
             }
             else
             {
                 request.headers.push_back(line);
             }
-        } while(sep != end);
+        } while(sep != end && valid);
+        input.erase(0, end + 4);
+
+        // Request bodies are not read, so the connection can't be reused
+        // if the request has one.
+        std::string length;
+        keep_alive = valid && request.persistent() &&
+                     ( !request.header("Content-Length", length) || length == "0" ) &&
+                     !request.header("Transfer-Encoding", length) &&
+                     (cfg_http_max_requests == 0 || ++requests < cfg_http_max_requests);
 
         // Handle request
-        std::ostringstream oss;
-        handleRequest(oss, request);
-        output = oss.str();
-        mask = writable;
+        bool head = valid && request.method == "HEAD";
+        if(!valid)
+            writeReply(reply, "400 Bad Request", "Bad Request\r\n");
+        else
+        if(!head && request.method != "GET")
+        {
+            std::string body = "Method Not Allowed\r\n";
+            writeHeader(reply, "405 Method Not Allowed", body.size());
+            reply << "Allow: GET, HEAD\r\nContent-Type: text/plain\r\n\r\n" << body;
+        }
+        else
+            handleRequest(reply, request);
+        queueReply(head);
+        if(cfg_http_timeout)
+            setTimer(1000ul*cfg_http_timeout);
 
         // DEBUG
         /*
         std::cout << "Received HTTP request: " << request.method << ' ' << request.location
-                  << '?' << request.query << "\n"
-                  << "Sending HTTP reply: " << output << "\n----" << std::endl;
+                  << '?' << request.query << std::endl;
         */
     }
+
+    if(!keep_alive)
+        input.clear();
+    updateMask();
+}
+
+void HttpRequestHandler::onTimeout()
+{
+    delete this;
 }
 
 void HttpRequestHandler::onWritable()
 {
-    if(output_pos < output.size())
+    size_t size = output.size();
+    if(!output.flush(fd, maxWriteSize))
     {
-        ssize_t bytes = write( fd, output.data() + output_pos,
-                                output.size() - output_pos );
-        if(bytes < 0)
-        {
-            // Write error!
+        // Write error!
 #ifdef DEBUG
-            perror("write");
+        perror("write");
 #endif
-            delete this;
-        }
-        else
-        {
-            output_pos += bytes;
-        }
+        delete this;
+        return;
+    }
+
+    // Release data files that have been sent
+    sent += size - output.size();
+    while(!references.empty() && references.front().first <= sent)
+    {
+        references.front().second->release();
+        references.pop_front();
     }
 
-    if(output_pos >= output.size())
+    if(output.empty() && !keep_alive)
     {
         delete this;
+        return;
     }
+
+    if(cfg_http_timeout)
+        setTimer(1000ul*cfg_http_timeout);
+
+    // Handle requests that were held back while output was queued
+    processInput();
 }
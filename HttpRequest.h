@@ -1,34 +1,65 @@
 #ifndef HTTPREQUEST_H_INCLUDED
 #define HTTPREQUEST_H_INCLUDED
 
+#include "OutputQueue.h"
 #include "Socket.h"
+#include <deque>
 #include <vector>
 #include <iostream>
 #include <map>
+#include <sstream>
 
 typedef std::multimap<std::string, std::string> QueryVarMap;
 QueryVarMap parseQueryString(const std::string query);
+std::string urldecode(const char *first, const char *last);
 
 struct HttpRequest
 {
-    std::string method, location, query;
+    std::string method, location, query, protocol;
     std::vector<std::string> headers;
     std::string body;
+
+    bool header(const std::string &name, std::string &value) const;
+    bool persistent() const;
 };
 
+// Serves HTTP/1.1 requests on a connection. Requests are handled as soon
+// as they have been received completely, so clients may pipeline them, and
+// the connection is kept open if the client wants to reuse it. Only GET
+// and HEAD are supported; replies to HEAD requests are sent without a body.
 class HttpRequestHandler : public Socket
 {
-    std::string input, output;
-    std::string::size_type output_pos;
+    std::string input;
+    OutputQueue output;
+    std::ostringstream reply;
+    bool keep_alive;            // reuse connection after the current reply
+    unsigned requests;          // number of requests handled
+
+    // Data files referenced by queued output, and the total number of bytes
+    // queued before the end of each file range.
+    std::deque<std::pair<unsigned long long, const MetaInfo*> > references;
+    unsigned long long queued, sent;
 
     virtual void handleRequest(std::ostream &os, HttpRequest &request) = 0;
 
+    void processInput();
+    void queueReply(bool headers_only = false);
+    void updateMask();
+
+protected:
+    void writeHeader(std::ostream &os, const char *status, long long length);
+    void writeReply( std::ostream &os, const char *status,
+                     const std::string &body );
+    void sendFile( const MetaInfo *info, unsigned file,
+                   long long offset, long long length );
+
 public:
     HttpRequestHandler(SocketSet &set, int fd);
     ~HttpRequestHandler();
 
     void onReadable();
     void onWritable();
+    void onTimeout();
 };
 
 
@@ -0,0 +1,250 @@
+#include "IoUring.h"
+
+#ifdef __linux__
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+// A read in progress
+struct PendingRead
+{
+    DiskJob *job;
+    const DataFile *file;
+    struct iovec iov;
+};
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter( int fd, unsigned to_submit,
+                           unsigned min_complete, unsigned flags )
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+IoUring::IoUring()
+    : ring_fd(-1), sq_ring(MAP_FAILED), sq_ring_size(0), sqes((io_uring_sqe*)MAP_FAILED),
+      sqes_size(0), cq_ring(MAP_FAILED), cq_ring_size(0),
+      queued(&mutex), inflight(0), unsubmitted(0)
+{
+}
+
+IoUring::~IoUring()
+{
+    if(sq_ring != MAP_FAILED)
+        munmap(sq_ring, sq_ring_size);
+    if(cq_ring != MAP_FAILED)
+        munmap(cq_ring, cq_ring_size);
+    if(sqes != MAP_FAILED)
+        munmap(sqes, sqes_size);
+    if(ring_fd >= 0)
+        close(ring_fd);
+}
+
+// Sets up a ring with the given number of submission queue entries.
+// Returns NULL if io_uring is not supported.
+IoUring *IoUring::create(unsigned entries)
+{
+    IoUring *ring = new IoUring();
+
+    struct io_uring_params p;
+    std::memset(&p, 0, sizeof(p));
+    ring->ring_fd = io_uring_setup(entries, &p);
+    if(ring->ring_fd < 0)
+    {
+        delete ring;
+        return NULL;
+    }
+    ring->sq_entries = p.sq_entries;
+    ring->cq_entries = p.cq_entries;
+
+    ring->sq_ring_size = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    ring->cq_ring_size = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    ring->sqes_size    = p.sq_entries*sizeof(struct io_uring_sqe);
+
+    ring->sq_ring = mmap( NULL, ring->sq_ring_size, PROT_READ|PROT_WRITE,
+                          MAP_SHARED|MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING );
+    ring->cq_ring = mmap( NULL, ring->cq_ring_size, PROT_READ|PROT_WRITE,
+                          MAP_SHARED|MAP_POPULATE, ring->ring_fd, IORING_OFF_CQ_RING );
+    ring->sqes = (struct io_uring_sqe*)mmap( NULL, ring->sqes_size,
+        PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES );
+    if( ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED ||
+        ring->sqes == MAP_FAILED )
+    {
+        delete ring;
+        return NULL;
+    }
+
+    char *sq = (char*)ring->sq_ring, *cq = (char*)ring->cq_ring;
+    ring->sq_head  = (unsigned*)(sq + p.sq_off.head);
+    ring->sq_tail  = (unsigned*)(sq + p.sq_off.tail);
+    ring->sq_mask  = (unsigned*)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + p.sq_off.array);
+    ring->cq_head  = (unsigned*)(cq + p.cq_off.head);
+    ring->cq_tail  = (unsigned*)(cq + p.cq_off.tail);
+    ring->cq_mask  = (unsigned*)(cq + p.cq_off.ring_mask);
+    ring->cqes     = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return ring;
+}
+
+// Queues the reads of a job; they are passed to the kernel by the next call
+// to flush(). Returns false if there is no room in the ring.
+bool IoUring::submit(DiskJob *job, const std::vector<DiskRead> &reads)
+{
+    omni_mutex_lock l(mutex);
+
+    unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE), tail = *sq_tail;
+    if( inflight + reads.size() > cq_entries ||
+        tail - head + reads.size() > sq_entries )
+        return false;
+
+    job->reads_pending = reads.size();
+    job->reads_ok      = true;
+    for(size_t n = 0; n < reads.size(); ++n)
+    {
+        PendingRead *pending = new PendingRead();
+        pending->job  = job;
+        pending->file = reads[n].file;
+        pending->iov.iov_base = reads[n].data;
+        pending->iov.iov_len  = reads[n].length;
+
+        unsigned index = tail & *sq_mask;
+        struct io_uring_sqe *sqe = &sqes[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqe->fd  = reads[n].file->fd();
+        sqe->off = reads[n].offset;
+        if(reads[n].data)
+        {
+            sqe->opcode = IORING_OP_READV;
+            sqe->addr   = (unsigned long)&pending->iov;
+            sqe->len    = 1;
+        }
+        else
+        {
+            sqe->opcode = IORING_OP_FADVISE;
+            sqe->len    = reads[n].length;
+            sqe->fadvise_advice = POSIX_FADV_WILLNEED;
+        }
+        sqe->user_data = (unsigned long)pending;
+        sq_array[index] = index;
+        ++tail;
+    }
+    __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+    inflight    += reads.size();
+    unsubmitted += reads.size();
+    queued.signal();
+    return true;
+}
+
+// Passes all queued reads to the kernel; the mutex must be held. Returns
+// false if some reads could not be submitted. Under memory pressure
+// (EAGAIN) or while completions are backed up (EBUSY) the kernel may
+// refuse them temporarily; the reaper then submits them again.
+bool IoUring::enter()
+{
+    while(unsubmitted > 0)
+    {
+        int submitted = io_uring_enter(ring_fd, unsubmitted, 0, 0);
+        if(submitted < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno != EAGAIN && errno != EBUSY)
+                perror("io_uring_enter");
+            return false;
+        }
+        unsubmitted -= submitted;
+    }
+    return true;
+}
+
+// Passes all queued reads to the kernel with a single system call
+void IoUring::flush()
+{
+    omni_mutex_lock l(mutex);
+    enter();
+}
+
+// Waits for at least one completion; adds jobs whose reads have all
+// finished to done. Reads that flush() failed to submit are retried here.
+void IoUring::reap(std::vector<DiskJob*> &done)
+{
+    bool waiting;
+    {
+        omni_mutex_lock l(mutex);
+        while(inflight == 0)
+            queued.wait();
+        enter();
+        waiting = inflight > unsubmitted;
+    }
+
+    if(!waiting)
+    {
+        // Nothing to wait for until the kernel accepts the reads
+        omni_thread::sleep(0, 1000000);
+        return;
+    }
+
+    if(io_uring_enter(ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+        perror("io_uring_enter");
+
+    unsigned head = *cq_head, tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    unsigned reaped = 0;
+    for( ; head != tail; ++head, ++reaped)
+    {
+        const struct io_uring_cqe &cqe = cqes[head & *cq_mask];
+        PendingRead *pending = (PendingRead*)(unsigned long)cqe.user_data;
+
+        // Note: failed prefetches are ignored; they are only a hint.
+        if(pending->iov.iov_base && cqe.res != (int)pending->iov.iov_len)
+            pending->job->reads_ok = false;
+        pending->file->release();
+        if(--pending->job->reads_pending == 0)
+            done.push_back(pending->job);
+        delete pending;
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+    omni_mutex_lock l(mutex);
+    inflight -= reaped;
+}
+
+#else /* ndef __linux__ */
+
+IoUring::IoUring() : queued(&mutex)
+{
+}
+
+IoUring::~IoUring()
+{
+}
+
+IoUring *IoUring::create(unsigned entries)
+{
+    return NULL;
+}
+
+bool IoUring::submit(DiskJob *job, const std::vector<DiskRead> &reads)
+{
+    return false;
+}
+
+void IoUring::flush()
+{
+}
+
+void IoUring::reap(std::vector<DiskJob*> &done)
+{
+}
+
+#endif /* def __linux__ */
@@ -0,0 +1,50 @@
+#ifndef IOURING_H_INCLUDED
+#define IOURING_H_INCLUDED
+
+#include "DiskIO.h"
+#include <omnithread.h>
+#include <vector>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+// Minimal io_uring(7) engine for disk reads, using the raw system calls.
+// Reads may be submitted from any thread; completions must be reaped by a
+// single thread.
+class IoUring
+{
+    int ring_fd;
+
+    // Submission queue
+    void *sq_ring;
+    size_t sq_ring_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    // Completion queue
+    void *cq_ring;
+    size_t cq_ring_size;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    omni_mutex mutex;
+    omni_condition queued;      // signalled when reads are queued
+    unsigned sq_entries, cq_entries, inflight, unsubmitted;
+
+    IoUring();
+    IoUring(const IoUring &);
+    IoUring &operator=(const IoUring &);
+
+    bool enter();
+
+public:
+    static IoUring *create(unsigned entries);
+    ~IoUring();
+
+    bool submit(DiskJob *job, const std::vector<DiskRead> &reads);
+    void flush();
+    void reap(std::vector<DiskJob*> &done);
+};
+
+#endif /* ndef IOURING_H_INCLUDED */
@@ -11,6 +11,7 @@
 #include <queue>
 
 MetaInfo::MetaInfo()
+    : super_seeding(false)
 {
 }
 
@@ -24,6 +25,31 @@ MetaInfo *MetaInfo::fromValue(const Value &value)
     try
     {
         result->announce = value.dictAt("announce").asString();
+        if(value.dictHasKey("announce-list"))
+        {
+            const Value &tiers = value.dictAt("announce-list");
+            result->announce_list.resize(tiers.listSize());
+            for(size_t n = 0; n < tiers.listSize(); ++n)
+            {
+                const Value &tier = tiers.listAt(n);
+                for(size_t m = 0; m < tier.listSize(); ++m)
+                    result->announce_list[n].push_back(tier.listAt(m).asString());
+            }
+        }
+        if(value.dictHasKey("url-list"))
+        {
+            // May be a single URL or a list of URLs
+            const Value &urls = value.dictAt("url-list");
+            if(urls.type == ::string)
+            {
+                result->url_list.push_back(urls.asString());
+            }
+            else
+            {
+                for(size_t n = 0; n < urls.listSize(); ++n)
+                    result->url_list.push_back(urls.listAt(n).asString());
+            }
+        }
 
         const Value &i = value.dictAt("info");
         result->m_name       = i.dictAt("name").asString();
@@ -85,6 +111,7 @@ MetaInfo *MetaInfo::fromValue(const Value &value)
         // Set info hash
         result->m_infohash = sha1(bencode(i));
 
+        result->buildIndex();
         return result;
     }
     catch(const ValueError &)
@@ -176,7 +203,8 @@ bool index(std::string::size_type start, const std::string &path, MetaInfo::File
 }
 
 MetaInfo *MetaInfo::generate(
-    const std::string &filepath, const std::string &announce, unsigned piece_length )
+    const std::string &filepath, const std::vector<std::string> &announce,
+    const std::string &web_seed, unsigned piece_length )
 {
 
     std::auto_ptr<MetaInfo> info(new MetaInfo());
@@ -203,8 +231,21 @@ MetaInfo *MetaInfo::generate(
     // Set name
     info->m_name = baseName(filepath.c_str());
 
-    // Set announce URL
-    info->announce = announce;
+    // Set announce URLs; with more than one, each is put in a tier of its
+    // own, so clients try them in order. Clients that don't support announce
+    // lists use the last one, which should be the most widely supported.
+    if(!announce.empty())
+        info->announce = announce.back();
+    if(announce.size() > 1)
+    {
+        for(size_t n = 0; n < announce.size(); ++n)
+            info->announce_list.push_back(std::vector<std::string>(1, announce[n]));
+    }
+    if(!web_seed.empty())
+        info->url_list.push_back(web_seed);
+
+    // Set location of data
+    info->data_path = filepath;
 
     // Create piece hashes
     info->piece_length  = piece_length;
@@ -251,10 +292,24 @@ MetaInfo *MetaInfo::generate(
     info->toValue(value);
     info->m_infohash = sha1(bencode(value.dictAt("info")));
 
+    info->buildIndex();
     return info.release();
 }
 
 
+// Computes the offset of each file, so byte ranges can be mapped to files
+// by binary search.
+void MetaInfo::buildIndex()
+{
+    file_offsets.resize(files.size());
+    long long offset = 0;
+    for(size_t n = 0; n < files.size(); ++n)
+    {
+        file_offsets[n] = offset;
+        offset += files[n].second;
+    }
+}
+
 bool MetaInfo::validRequest(unsigned piece, unsigned begin, unsigned length) const
 {
     if(piece >= pieces())
@@ -266,49 +321,95 @@ bool MetaInfo::validRequest(unsigned piece, unsigned begin, unsigned length) con
 
 bool MetaInfo::fetchPiece(unsigned piece, ByteBuffer &data) const
 {
-    // Note: assumes current working directory is data directory
-    // FIXME: make this more efficient for torrents with a large number of files
+    std::vector<FileExtent> extents;
+    unsigned size = pieceLength(piece);
+    if(!fileExtents(piece, 0, size, extents))
+        return false;
 
-    long long skip = piece_length*piece, pos = 0ll, size = pieceLength(piece);
     data.resize(size);
+    size_t pos = 0;
+    for(size_t n = 0; n < extents.size(); ++n)
+    {
+        const DataFile *file = openFile(extents[n].file);
+        if(file == NULL)
+            return false;
+        bool ok = file->read(extents[n].offset, &data[pos], extents[n].length);
+        file->release();
+        if(!ok)
+            return false;
+        pos += extents[n].length;
+    }
+    return true;
+}
+
+// Maps a range of bytes in a piece to the data file ranges that contain it.
+// All reads of piece data go through this function.
+bool MetaInfo::fileExtents( unsigned piece, unsigned begin, unsigned length,
+                            std::vector<FileExtent> &extents ) const
+{
+    extents.clear();
+    if(!validRequest(piece, begin, length))
+        return false;
 
+    long long pos = piece_length*piece + begin, size = length;
     if(type == file)
     {
-        // Read piece from a file
-        std::ifstream ifs(m_name.c_str(), std::ifstream::binary);
-        ifs.seekg(piece_length*piece, std::ios_base::beg);
-        return ifs.read(&data[0], pieceLength(piece));
+        FileExtent extent = { 0, pos, size };
+        extents.push_back(extent);
+        return true;
     }
+
+    // Find the last file starting at or before pos
+    size_t n = std::upper_bound( file_offsets.begin(), file_offsets.end(), pos )
+               - file_offsets.begin();
+    if(n == 0)
+        return false;
+    for(--n; n < files.size() && size > 0; ++n)
+    {
+        long long skip = pos - file_offsets[n];
+        if(files[n].second <= skip)
+            continue;   // empty file
+
+        FileExtent extent = { unsigned(n), skip, std::min(files[n].second - skip, size) };
+        extents.push_back(extent);
+        pos  += extent.length;
+        size -= extent.length;
+    }
+    return size == 0;
+}
+
+// Opens a data file for reading through the process-wide file cache. The
+// caller must release the result, which is NULL if the file can't be opened.
+const DataFile *MetaInfo::openFile(unsigned index) const
+{
+    if(files.empty())
+        return FileCache::instance().open(data_path);
     else
+        return FileCache::instance().open(data_path + files.at(index).first);
+}
+
+// Finds the data file with the given path in the torrent (empty for a
+// single-file torrent, or starting with a slash otherwise).
+bool MetaInfo::findFile( const std::string &path,
+                         unsigned &index, long long &length ) const
+{
+    if(type == file)
     {
-        // Read piece from a directory
-        chdir(name().c_str());
-        for( FileList::const_iterator i = files.begin();
-            i != files.end(); ++i )
-        {
-            const long long &file_size = i->second;
-            if(file_size <= skip)
-            {
-                // Skip this file entirely
-                skip -= file_size;
-                continue;
-            }
+        index  = 0;
+        length = this->length;
+        return path.empty();
+    }
 
-            long long read_size = std::min(file_size - skip, size - pos);
-            std::ifstream ifs(i->first.c_str() + 1, std::ifstream::binary);
-            if(skip > 0)
-            {
-                if(!ifs.seekg(skip, std::ios_base::beg))
-                    break;
-                skip = 0;
-            }
-            if(!ifs.read(&data[pos], read_size))
-                break;
-            pos += read_size;
+    for(size_t n = 0; n < files.size(); ++n)
+    {
+        if(files[n].first == path)
+        {
+            index  = n;
+            length = files[n].second;
+            return true;
         }
-        chdir("..");
-        return pos == size;
     }
+    return false;
 }
 
 void MetaInfo::toValue(Value &result) const
@@ -316,6 +417,25 @@ void MetaInfo::toValue(Value &result) const
     result.clear();
     Dict &resultDict = result.makeDict();
     resultDict["announce"].assign(announce);
+    if(!announce_list.empty())
+    {
+        List &tiersList = resultDict["announce-list"].makeList();
+        tiersList.resize(announce_list.size());
+        for(size_t n = 0; n < announce_list.size(); ++n)
+        {
+            List &tierList = tiersList[n].makeList();
+            tierList.resize(announce_list[n].size());
+            for(size_t m = 0; m < announce_list[n].size(); ++m)
+                tierList[m].assign(announce_list[n][m]);
+        }
+    }
+    if(!url_list.empty())
+    {
+        List &urlList = resultDict["url-list"].makeList();
+        urlList.resize(url_list.size());
+        for(size_t n = 0; n < url_list.size(); ++n)
+            urlList[n].assign(url_list[n]);
+    }
 
     Dict &infoDict = resultDict["info"].makeDict();
     infoDict["name"].assign(m_name);
@@ -1,6 +1,7 @@
 #ifndef METAINFO_H_INCLUDED
 #define METAINFO_H_INCLUDED
 
+#include "FileCache.h"
 #include "RefCountingObject.h"
 #include "bcoding.h"
 #include <algorithm>
@@ -17,8 +18,17 @@ class MetaInfo : public RefCountingObject
 public:
     typedef std::vector<std::pair<std::string, long long> > FileList;
 
+    // A contiguous range of bytes in one of the torrent's data files
+    struct FileExtent
+    {
+        unsigned file;
+        long long offset, length;
+    };
+
 private:
     std::string announce;
+    std::vector<std::vector<std::string> > announce_list;   // tiers (BEP 12)
+    std::vector<std::string> url_list;      // web seeds (BEP 19)
 
     enum { file, directory } type;
     std::string m_name;
@@ -27,10 +37,14 @@ private:
     std::string piece_hashes;
 
     FileList files;
+    std::vector<long long> file_offsets;    // offset of each file in torrent
 
     std::string m_infohash;
+    std::string data_path;
+    bool super_seeding;
 
     MetaInfo();
+    void buildIndex();
 
 public:
     static MetaInfo *fromValue(const Value &value);
@@ -38,18 +52,28 @@ public:
     static MetaInfo *fromPath(const char *filepath);
 
     static MetaInfo *generate( const std::string &filepath,
-        const std::string &announce, unsigned piece_length = 1<<18 );
+        const std::vector<std::string> &announce, const std::string &web_seed = "",
+        unsigned piece_length = 1<<18 );
 
     ~MetaInfo();
 
     inline const std::string &name() const { return m_name; }
     inline const std::string &infohash() const { return m_infohash; }
+    inline const std::string &dataPath() const { return data_path; }
+    inline void dataPath(const std::string &path) { data_path = path; }
+    inline bool superSeeding() const { return super_seeding; }
+    inline void superSeeding(bool enabled) { super_seeding = enabled; }
+    inline const std::vector<std::string> &urlList() const { return url_list; }
 
     inline unsigned pieces() const;
     inline unsigned pieceLength(unsigned piece) const;
 
     bool validRequest(unsigned piece, unsigned begin, unsigned length) const;
     bool fetchPiece(unsigned piece, ByteBuffer &data) const;
+    bool fileExtents( unsigned piece, unsigned begin, unsigned length,
+                      std::vector<FileExtent> &extents ) const;
+    const DataFile *openFile(unsigned index) const;
+    bool findFile(const std::string &path, unsigned &index, long long &length) const;
 
     void toValue(Value &result) const;
     void toFile(std::ostream &stream) const;
@@ -0,0 +1,173 @@
+#include "OutputQueue.h"
+#ifdef __MINGW32__
+#include <winsock.h>
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+#ifdef HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
+#include <algorithm>
+#include <cerrno>
+
+// Buffers are appended to the last queued buffer up to this size
+static const size_t max_gather_size = 4096;
+
+// Maximum number of buffers written with a single call to sendmsg()
+static const int max_iovecs = 64;
+
+OutputQueue::OutputQueue()
+    : pos(0), m_size(0), file_info(NULL), file_index(0), file(NULL)
+{
+}
+
+OutputQueue::~OutputQueue()
+{
+    if(file)
+        file->release();
+}
+
+void OutputQueue::push(const char *data, size_t size)
+{
+    if( !chunks.empty() && chunks.back().info == NULL &&
+        chunks.back().data.size() + size <= max_gather_size )
+    {
+        // Gather small buffers into one
+        ByteBuffer &back = chunks.back().data;
+        back.insert(back.end(), data, data + size);
+    }
+    else
+    {
+        chunks.push_back(Chunk());
+        Chunk &chunk = chunks.back();
+        chunk.data.assign(data, data + size);
+        chunk.info   = NULL;
+        chunk.file   = 0;
+        chunk.offset = 0;
+        chunk.length = size;
+    }
+    m_size += size;
+}
+
+// Queues a range of a data file; info must remain valid until it is sent.
+void OutputQueue::pushFile( const MetaInfo *info, unsigned file,
+                            long long offset, unsigned length )
+{
+    chunks.push_back(Chunk());
+    Chunk &chunk = chunks.back();
+    chunk.info   = info;
+    chunk.file   = file;
+    chunk.offset = offset;
+    chunk.length = length;
+    m_size += length;
+}
+
+// Removes the given number of bytes from the front of the queue
+void OutputQueue::consume(size_t bytes)
+{
+    m_size -= bytes;
+    while(bytes > 0)
+    {
+        Chunk &chunk = chunks.front();
+        size_t size = (chunk.info ? chunk.length : chunk.data.size()) - pos;
+        if(bytes < size)
+        {
+            pos += bytes;
+            break;
+        }
+        bytes -= size;
+        chunks.pop_front();
+        pos = 0;
+    }
+}
+
+ssize_t OutputQueue::sendFile(int fd, const Chunk &chunk, size_t length)
+{
+#ifdef HAVE_SENDFILE
+    if(file == NULL || file_info != chunk.info || file_index != chunk.file)
+    {
+        if(file)
+            file->release();
+        file_info  = chunk.info;
+        file_index = chunk.file;
+        file       = file_info->openFile(file_index);
+        if(file == NULL)
+            return -1;
+    }
+
+    off_t offset = chunk.offset + pos;
+    ssize_t bytes = sendfile(fd, file->fd(), &offset, length);
+    if(bytes == 0)
+    {
+        // Data file was truncated
+        errno = EIO;
+        return -1;
+    }
+    return bytes;
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+// Writes queued data until the socket would block, the queue is empty, or
+// limit bytes have been written. Returns false if an error occurred (and
+// the connection should be closed).
+bool OutputQueue::flush(int fd, size_t limit)
+{
+    while(!chunks.empty() && limit > 0)
+    {
+        ssize_t bytes;
+        size_t requested;
+
+        if(chunks.front().info)
+        {
+            requested = std::min<size_t>(chunks.front().length - pos, limit);
+            bytes = sendFile(fd, chunks.front(), requested);
+        }
+        else
+        {
+#ifdef __MINGW32__
+            // WinSock 1.1 has no gathering writes; send one buffer at a time
+            requested = std::min(chunks.front().data.size() - pos, limit);
+            bytes = send(fd, &chunks.front().data[pos], requested, 0);
+#else
+            struct iovec iov[max_iovecs];
+            int count = 0;
+            requested = 0;
+            std::deque<Chunk>::iterator i = chunks.begin();
+            for( ; i != chunks.end() && i->info == NULL && count < max_iovecs &&
+                   requested < limit; ++i, ++count )
+            {
+                size_t skip = (count == 0) ? pos : 0;
+                iov[count].iov_base = &i->data[skip];
+                iov[count].iov_len  = std::min(i->data.size() - skip, limit - requested);
+                requested += iov[count].iov_len;
+            }
+
+            struct msghdr msg = { };
+            msg.msg_iov    = iov;
+            msg.msg_iovlen = count;
+            int flags = 0;
+#ifdef MSG_MORE
+            // Let the kernel combine piece headers with the file data after it
+            if(i != chunks.end() && requested < limit)
+                flags |= MSG_MORE;
+#endif
+            bytes = sendmsg(fd, &msg, flags);
+#endif
+        }
+
+        if(bytes < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+
+        consume(bytes);
+        limit -= bytes;
+        if(size_t(bytes) < requested)
+            break;  // socket buffer is full
+    }
+    return true;
+}
@@ -0,0 +1,61 @@
+#ifndef OUTPUTQUEUE_H_INCLUDED
+#define OUTPUTQUEUE_H_INCLUDED
+
+#include "MetaInfo.h"
+#include <deque>
+
+#ifdef __linux__
+#define HAVE_SENDFILE
+#endif
+
+// Queue of data to be written to a non-blocking socket. Consecutive buffers
+// are gathered and written with a single system call; ranges of data files
+// are sent with sendfile() (if available).
+class OutputQueue
+{
+    struct Chunk
+    {
+        ByteBuffer data;
+        const MetaInfo *info;   // owner of file data (NULL for buffers)
+        unsigned file;
+        long long offset;
+        unsigned length;
+    };
+
+    std::deque<Chunk> chunks;
+    unsigned pos;               // bytes of first chunk written so far
+    size_t m_size;              // total bytes queued
+
+    // Data file opened most recently
+    const MetaInfo *file_info;
+    unsigned file_index;
+    const DataFile *file;
+
+    OutputQueue(const OutputQueue &);
+    OutputQueue &operator=(const OutputQueue &);
+
+    ssize_t sendFile(int fd, const Chunk &chunk, size_t length);
+    void consume(size_t bytes);
+
+public:
+    OutputQueue();
+    ~OutputQueue();
+
+    inline bool empty() const { return chunks.empty(); }
+    inline size_t size() const { return m_size; }
+
+    void push(const char *data, size_t size);
+    inline void push(const ByteBuffer &data);
+    void pushFile( const MetaInfo *info, unsigned file,
+                   long long offset, unsigned length );
+
+    bool flush(int fd, size_t limit = size_t(-1));
+};
+
+void OutputQueue::push(const ByteBuffer &data)
+{
+    if(!data.empty())
+        push(&data[0], data.size());
+}
+
+#endif /* ndef OUTPUTQUEUE_H_INCLUDED */
@@ -0,0 +1,231 @@
+#include "PeerTable.h"
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+// Initial size of the hash table (must be a power of two)
+static const size_t initial_slots = 16;
+
+PeerTable::PeerTable()
+    : slots(initial_slots, -1), oldest(-1), newest(-1), seed(std::rand()),
+      m_seeders(0), m_completed(0)
+{
+}
+
+// FNV-1a, starting from a random seed, since peer ids are chosen by clients
+unsigned PeerTable::hash(const char *peer_id) const
+{
+    unsigned h = 2166136261u ^ seed;
+    for(int n = 0; n < 20; ++n)
+        h = (h ^ (unsigned char)peer_id[n])*16777619u;
+    return h;
+}
+
+// Returns the slot containing the given peer id, or the empty slot where it
+// would be inserted.
+size_t PeerTable::findSlot(const char *peer_id) const
+{
+    size_t mask = slots.size() - 1, s = hash(peer_id) & mask;
+    while( slots[s] >= 0 &&
+           std::memcmp(entries[slots[s]].peer.peer_id, peer_id, 20) != 0 )
+        s = (s + 1) & mask;
+    return s;
+}
+
+void PeerTable::rehash(size_t size)
+{
+    slots.assign(size, -1);
+    for(size_t n = 0; n < entries.size(); ++n)
+        slots[findSlot(entries[n].peer.peer_id)] = n;
+}
+
+// Links an entry as the most recent one
+void PeerTable::link(int n)
+{
+    entries[n].older = newest;
+    entries[n].newer = -1;
+    if(newest >= 0)
+        entries[newest].newer = n;
+    else
+        oldest = n;
+    newest = n;
+}
+
+void PeerTable::unlink(int n)
+{
+    Entry &entry = entries[n];
+    if(entry.older >= 0)
+        entries[entry.older].newer = entry.newer;
+    else
+        oldest = entry.newer;
+    if(entry.newer >= 0)
+        entries[entry.newer].older = entry.older;
+    else
+        newest = entry.older;
+}
+
+// Removes an entry by moving the last entry into its place
+void PeerTable::removeAt(int n)
+{
+    unlink(n);
+    if(entries[n].peer.left == 0)
+        --m_seeders;
+
+    // Clear the slot, and move later entries of its cluster back, so they
+    // remain reachable from their home slot.
+    size_t mask = slots.size() - 1, s = findSlot(entries[n].peer.peer_id);
+    slots[s] = -1;
+    for(size_t t = (s + 1) & mask; slots[t] >= 0; t = (t + 1) & mask)
+    {
+        size_t home = hash(entries[slots[t]].peer.peer_id) & mask;
+        if(((t - home) & mask) >= ((t - s) & mask))
+        {
+            slots[s] = slots[t];
+            slots[t] = -1;
+            s = t;
+        }
+    }
+
+    int last = entries.size() - 1;
+    if(n != last)
+    {
+        entries[n] = entries[last];
+        records.replace(6*n, 6, records, 6*last, 6);
+        slots[findSlot(entries[n].peer.peer_id)] = n;
+        if(entries[n].older >= 0)
+            entries[entries[n].older].newer = n;
+        else
+            oldest = n;
+        if(entries[n].newer >= 0)
+            entries[entries[n].newer].older = n;
+        else
+            newest = n;
+    }
+    entries.pop_back();
+    records.resize(6*last);
+}
+
+// Exchanges the positions of two entries in the array
+void PeerTable::swap(int i, int j)
+{
+    if(i == j)
+        return;
+
+    size_t si = findSlot(entries[i].peer.peer_id),
+           sj = findSlot(entries[j].peer.peer_id);
+    std::swap(entries[i], entries[j]);
+    slots[si] = j;
+    slots[sj] = i;
+    for(int k = 0; k < 6; ++k)
+        std::swap(records[6*i + k], records[6*j + k]);
+
+    // Fix links, which may also point from one of the entries to the other
+    int moved[2] = { i, j };
+    for(int k = 0; k < 2; ++k)
+    {
+        Entry &entry = entries[moved[k]];
+        if(entry.older == i || entry.older == j)
+            entry.older = i + j - entry.older;
+        if(entry.newer == i || entry.newer == j)
+            entry.newer = i + j - entry.newer;
+    }
+    for(int k = 0; k < 2; ++k)
+    {
+        const Entry &entry = entries[moved[k]];
+        if(entry.older >= 0)
+            entries[entry.older].newer = moved[k];
+        else
+            oldest = moved[k];
+        if(entry.newer >= 0)
+            entries[entry.newer].older = moved[k];
+        else
+            newest = moved[k];
+    }
+}
+
+const PeerInfo *PeerTable::find(const char *peer_id) const
+{
+    int n = slots[findSlot(peer_id)];
+    return n >= 0 ? &entries[n].peer : NULL;
+}
+
+// Stores the state of a peer (adding it if it is new) and makes it the
+// most recent one.
+const PeerInfo &PeerTable::update(const PeerInfo &peer)
+{
+    size_t s = findSlot(peer.peer_id);
+    int n = slots[s];
+    if(n >= 0)
+    {
+        unlink(n);
+        if(entries[n].peer.left == 0)
+            --m_seeders;
+        entries[n].peer = peer;
+    }
+    else
+    {
+        n = entries.size();
+        entries.push_back(Entry());
+        entries[n].peer = peer;
+        records.resize(6*entries.size());
+        slots[s] = n;
+        if(2*entries.size() > slots.size())
+            rehash(2*slots.size());
+    }
+    link(n);
+    if(peer.left == 0)
+        ++m_seeders;
+
+    // The address is stored in network byte order already
+    char *record = &records[6*n];
+    std::memcpy(record, &peer.ip, 4);
+    record[4] = peer.port >> 8;
+    record[5] = peer.port;
+    return entries[n].peer;
+}
+
+bool PeerTable::remove(const char *peer_id)
+{
+    int n = slots[findSlot(peer_id)];
+    if(n < 0)
+        return false;
+    removeAt(n);
+    return true;
+}
+
+void PeerTable::removeOldest()
+{
+    if(oldest >= 0)
+        removeAt(oldest);
+}
+
+// Removes peers that last announced at or before the given time
+void PeerTable::purge(std::time_t last_time)
+{
+    while(oldest >= 0 && entries[oldest].peer.last_time <= last_time)
+        removeAt(oldest);
+}
+
+// Moves up to count randomly chosen peers (other than the one with the
+// given id, if any) to the front of the array, with a partial Fisher-Yates
+// shuffle, and returns how many were chosen. This takes time proportional
+// to the number of peers chosen, not the number of peers in the table.
+size_t PeerTable::sample(size_t count, const char *omit_id)
+{
+    size_t size = entries.size();
+    if(omit_id && size > 0)
+    {
+        int n = slots[findSlot(omit_id)];
+        if(n >= 0)
+        {
+            swap(n, size - 1);
+            --size;
+        }
+    }
+
+    if(count > size)
+        count = size;
+    for(size_t n = 0; n < count; ++n)
+        swap(n, n + std::rand()%(size - n));
+    return count;
+}
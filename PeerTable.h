@@ -0,0 +1,69 @@
+#ifndef PEERTABLE_H_INCLUDED
+#define PEERTABLE_H_INCLUDED
+
+#include <string>
+#include <vector>
+#include <ctime>
+
+struct PeerInfo
+{
+    char info_hash[20], peer_id[20];
+    unsigned ip;
+    unsigned short port;
+    std::time_t last_time;
+
+    long long uploaded, downloaded, left;
+};
+
+// The peers of a torrent known to the tracker. Peers are stored in a dense
+// array (so random peers can be picked), indexed by a hash table on peer id,
+// and linked in order of their last announce (so the peers that announced
+// least recently can be evicted or purged). Lookup, insertion and removal
+// take constant expected time.
+//
+// The compact encoding of each peer (BEP 23) is kept in a parallel array,
+// so a random sample of peers can be copied into a reply directly.
+class PeerTable
+{
+    struct Entry
+    {
+        PeerInfo peer;
+        int older, newer;       // neighbours in recency order (or -1)
+    };
+
+    std::vector<Entry> entries;
+    std::string records;        // compact peer info of entries, 6 bytes each
+    std::vector<int> slots;     // open addressing; entry index or -1
+    int oldest, newest;
+    unsigned seed;              // randomizes hashes of peer ids
+    size_t m_seeders;           // number of peers with nothing left to download
+    unsigned m_completed;       // number of completed downloads reported
+
+    unsigned hash(const char *peer_id) const;
+    size_t findSlot(const char *peer_id) const;
+    void rehash(size_t size);
+    void link(int n);
+    void unlink(int n);
+    void removeAt(int n);
+    void swap(int i, int j);
+
+public:
+    PeerTable();
+
+    inline size_t size() const { return entries.size(); }
+    inline const PeerInfo &operator[](size_t n) const { return entries[n].peer; }
+    inline const char *compact() const { return records.data(); }
+    inline size_t seeders() const { return m_seeders; }
+    inline size_t leechers() const { return entries.size() - m_seeders; }
+    inline unsigned completed() const { return m_completed; }
+    inline void addCompleted() { ++m_completed; }
+
+    const PeerInfo *find(const char *peer_id) const;
+    const PeerInfo &update(const PeerInfo &peer);
+    bool remove(const char *peer_id);
+    void removeOldest();
+    void purge(std::time_t last_time);
+    size_t sample(size_t count, const char *omit_id);
+};
+
+#endif /* ndef PEERTABLE_H_INCLUDED */
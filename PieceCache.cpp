@@ -0,0 +1,80 @@
+#include "PieceCache.h"
+
+PieceCache::PieceCache(size_t capacity)
+    : loaded(&mutex), m_size(0), m_capacity(capacity)
+{
+}
+
+PieceCache::~PieceCache()
+{
+    for(EntryMap::iterator i = entries.begin(); i != entries.end(); ++i)
+        if(i->second.piece)
+            i->second.piece->release();
+}
+
+// Removes least recently used pieces until the cache fits its capacity.
+// Note: must be called with the mutex locked.
+void PieceCache::evict()
+{
+    while(m_size > m_capacity && !lru.empty())
+    {
+        EntryMap::iterator i = entries.find(lru.back());
+        lru.pop_back();
+        m_size -= i->second.piece->data.size();
+        i->second.piece->release();
+        entries.erase(i);
+    }
+}
+
+// Returns the data of the given piece, reading it from disk if it is not
+// cached. The caller must release the result, which is NULL if the piece
+// could not be read.
+const PieceData *PieceCache::fetch(const MetaInfo &info, unsigned piece)
+{
+    Key key;
+    std::memcpy(key.infohash, info.infohash().data(), sizeof(key.infohash));
+    key.piece = piece;
+
+    omni_mutex_lock l(mutex);
+
+    EntryMap::iterator i;
+    while((i = entries.find(key)) != entries.end())
+    {
+        if(i->second.piece)
+        {
+            // Cache hit; mark piece as most recently used
+            lru.splice(lru.begin(), lru, i->second.lru);
+            i->second.piece->acquire();
+            return i->second.piece;
+        }
+
+        // Another thread is loading this piece; wait for it to finish
+        loaded.wait();
+    }
+
+    // Cache miss; load the piece without holding the lock
+    entries[key].piece = NULL;
+    mutex.unlock();
+    PieceData *data = new PieceData();
+    bool ok = info.fetchPiece(piece, data->data);
+    mutex.lock();
+
+    i = entries.find(key);
+    if(!ok)
+    {
+        entries.erase(i);
+        data->release();
+        data = NULL;
+    }
+    else
+    {
+        // Add to cache (which holds one reference) and return to caller
+        data->acquire();
+        i->second.piece = data;
+        i->second.lru   = lru.insert(lru.begin(), key);
+        m_size += data->data.size();
+        evict();
+    }
+    loaded.broadcast();
+    return data;
+}
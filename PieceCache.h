@@ -0,0 +1,66 @@
+#ifndef PIECECACHE_H_INCLUDED
+#define PIECECACHE_H_INCLUDED
+
+#include "MetaInfo.h"
+#include "RefCountingObject.h"
+#include <omnithread.h>
+#include <cstring>
+#include <list>
+#include <map>
+
+// Reference counted piece data, shared between peers
+class PieceData : public RefCountingObject
+{
+public:
+    ByteBuffer data;
+};
+
+// Process-wide cache of piece data with least-recently-used eviction.
+// Concurrent requests for a piece that is not cached yet are coalesced, so
+// that it is read from disk only once.
+class PieceCache
+{
+    struct Key
+    {
+        char infohash[20];
+        unsigned piece;
+
+        inline bool operator< (const Key &k) const;
+    };
+
+    struct Entry
+    {
+        PieceData *piece;   // NULL while loading
+        std::list<Key>::iterator lru;
+    };
+
+    typedef std::map<Key, Entry> EntryMap;
+
+    omni_mutex mutex;
+    omni_condition loaded;
+    EntryMap entries;
+    std::list<Key> lru;     // cached pieces; most recently used first
+    size_t m_size, m_capacity;
+
+    PieceCache(const PieceCache &);
+    PieceCache &operator=(const PieceCache &);
+
+    void evict();
+
+public:
+    PieceCache(size_t capacity);
+    ~PieceCache();
+
+    inline size_t size() const { return m_size; }
+    inline size_t capacity() const { return m_capacity; }
+
+    const PieceData *fetch(const MetaInfo &info, unsigned piece);
+};
+
+bool PieceCache::Key::operator< (const Key &k) const
+{
+    int d = std::memcmp(infohash, k.infohash, sizeof(infohash));
+    return d < 0 || (d == 0 && piece < k.piece);
+}
+
+#endif /* ndef PIECECACHE_H_INCLUDED */
@@ -0,0 +1,32 @@
+#ifndef RATEESTIMATOR_H_INCLUDED
+#define RATEESTIMATOR_H_INCLUDED
+
+// Estimates a transfer rate (in bytes per second) as an exponentially
+// weighted moving average, updated once per second.
+class RateEstimator
+{
+    unsigned m_bytes;   // bytes transferred during the current second
+    double m_rate;
+
+public:
+    inline RateEstimator() : m_bytes(0), m_rate(0) { };
+
+    inline void add(unsigned bytes) { m_bytes += bytes; }
+    inline void update(unsigned seconds);
+    inline unsigned rate() const { return unsigned(m_rate); }
+};
+
+// Ends the current period; intervals of more than one second (e.g. after a
+// slow loop iteration) count as that many seconds of the same average rate.
+void RateEstimator::update(unsigned seconds)
+{
+    if(seconds == 0)
+        return;
+    const double weight = 0.2;
+    double current = double(m_bytes)/seconds;
+    for(unsigned n = 0; n < seconds; ++n)
+        m_rate += weight*(current - m_rate);
+    m_bytes = 0;
+}
+
+#endif /* ndef RATEESTIMATOR_H_INCLUDED */
@@ -1,6 +1,8 @@
 #ifndef REFCOUNTINGOBJECT_H_INCLUDED
 #define REFCOUNTINGOBJECT_H_INCLUDED
 
+// Note: reference counts are updated atomically, so objects may be shared
+// between threads.
 class RefCountingObject
 {
     mutable int ref_count;
@@ -17,7 +19,7 @@ RefCountingObject::RefCountingObject() : ref_count(1)
 
 void RefCountingObject::acquire() const
 {
-    ++ref_count;
+    __sync_add_and_fetch(&ref_count, 1);
 }
 
 
@@ -42,7 +44,7 @@ void RefCountingObject::release() const
     }
 #endif
 
-    if(--ref_count == 0)
+    if(__sync_sub_and_fetch(&ref_count, 1) == 0)
     {
         delete this;
     }
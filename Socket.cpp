@@ -3,13 +3,128 @@
 #include <winsock.h>
 #define close(fd) closesocket(fd)
 #else
+#include <fcntl.h>
 #include <unistd.h>
-#include <sys/select.h>
 #include <sys/socket.h>
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#else
+#include <sys/select.h>
 #endif
+#endif
+#include <cerrno>
+#include <cstdio>
 #include <vector>
 
-static std::vector<Socket*> sockets;
+#ifdef USE_EPOLL
+
+// Maximum number of events retrieved by a single call to epoll_wait()
+static const int max_events = 256;
+
+static unsigned epollEvents(int mask)
+{
+    return ((mask & readable)  ? EPOLLIN  : 0) |
+           ((mask & writable)  ? EPOLLOUT : 0) |
+           ((mask & exception) ? EPOLLPRI : 0);
+}
+
+SocketSet::SocketSet() : epoll_fd(epoll_create(max_events))
+{
+    if(epoll_fd < 0)
+        perror("epoll_create");
+}
+
+SocketSet::~SocketSet()
+{
+    if(epoll_fd >= 0)
+        close(epoll_fd);
+}
+
+void SocketSet::addSocket(Socket &socket)
+{
+    if(socket.fd >= 0)
+    {
+        if(int(sockets.size()) <= socket.fd)
+            sockets.resize(socket.fd + 1);
+        sockets[socket.fd] = &socket;
+
+        struct epoll_event event;
+        event.events  = epollEvents(socket.m_mask);
+        event.data.fd = socket.fd;
+        if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket.fd, &event) != 0)
+            perror("epoll_ctl");
+    }
+}
+
+void SocketSet::updateSocket(Socket &socket)
+{
+    if(socket.fd >= 0)
+    {
+        struct epoll_event event;
+        event.events  = epollEvents(socket.m_mask);
+        event.data.fd = socket.fd;
+        if(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, socket.fd, &event) != 0)
+            perror("epoll_ctl");
+    }
+}
+
+void SocketSet::removeSocket(Socket &socket)
+{
+    if(socket.fd >= 0 && socket.fd < int(sockets.size()))
+    {
+        sockets[socket.fd] = NULL;
+
+        // Note: a non-NULL event pointer is required by kernels before 2.6.9
+        struct epoll_event event;
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, socket.fd, &event);
+    }
+}
+
+// Waits for events on the sockets (for at most timeout_ms milliseconds, or
+// until the first timer expires) and calls the handlers, followed by those
+// of expired timers.
+bool SocketSet::process(int timeout_ms)
+{
+    struct epoll_event events[max_events];
+
+    timeout_ms = m_timers.timeout(timeout_ms);
+    int nevents = epoll_wait(epoll_fd, events, max_events, timeout_ms);
+    if(nevents < 0)
+        return errno == EINTR;
+
+    for(int n = 0; n < nevents; ++n)
+    {
+        /* Note that a socket may be destroyed by handlers called earlier in
+           this loop, so it must be looked up again before every call. */
+        int fd = events[n].data.fd;
+        unsigned ev = events[n].events;
+
+        // Errors and hang-ups are reported through the regular handlers,
+        // just like select() marks a failed socket as readable and writable.
+        if(ev & (EPOLLERR|EPOLLHUP))
+            ev |= epollEvents(sockets[fd] ? sockets[fd]->m_mask : 0);
+
+        if((ev & EPOLLIN) && sockets[fd])
+            sockets[fd]->onReadable();
+        if((ev & EPOLLOUT) && sockets[fd])
+            sockets[fd]->onWritable();
+        if((ev & EPOLLPRI) && sockets[fd])
+            sockets[fd]->onException();
+    }
+
+    m_timers.run();
+    return true;
+}
+
+#else /* select() based implementation */
+
+SocketSet::SocketSet()
+{
+}
+
+SocketSet::~SocketSet()
+{
+}
 
 void SocketSet::addSocket(Socket &socket)
 {
@@ -21,6 +136,11 @@ void SocketSet::addSocket(Socket &socket)
     }
 }
 
+void SocketSet::updateSocket(Socket &socket)
+{
+    // Masks are read on every call to process(); nothing to do here.
+}
+
 void SocketSet::removeSocket(Socket &socket)
 {
     if(socket.fd >= 0 && socket.fd < int(sockets.size()))
@@ -31,6 +151,8 @@ void SocketSet::removeSocket(Socket &socket)
 
 bool SocketSet::process(int timeout_ms)
 {
+    timeout_ms = m_timers.timeout(timeout_ms);
+
     struct timeval timeout;
     timeout.tv_sec  = timeout_ms/1000;
     timeout.tv_usec = 1000*(timeout_ms%1000);
@@ -45,11 +167,11 @@ bool SocketSet::process(int timeout_ms)
     for(int n = 0; n < int(sockets.size()); ++n)
         if(sockets[n])
         {
-            if(sockets[n]->mask & readable)
+            if(sockets[n]->m_mask & readable)
                 FD_SET(n, &readfds);
-            if(sockets[n]->mask & writable)
+            if(sockets[n]->m_mask & writable)
                 FD_SET(n, &writefds);
-            if(sockets[n]->mask & exception)
+            if(sockets[n]->m_mask & exception)
                 FD_SET(n, &exceptfds);
             nfds = n + 1;
         }
@@ -69,12 +191,15 @@ bool SocketSet::process(int timeout_ms)
                 sockets[n]->onException();
         }
     }
-    
+
+    m_timers.run();
     return true;
 }
 
+#endif /* def USE_EPOLL */
 
-Socket::Socket(SocketSet &set, int fd, int mask) : fd(fd), mask(mask), m_set(set)
+
+Socket::Socket(SocketSet &set, int fd, int mask) : m_mask(mask), fd(fd), m_set(set)
 {
     m_set.addSocket(*this);
 }
@@ -85,6 +210,17 @@ Socket::~Socket()
     close(fd);
 }
 
+bool Socket::setNonBlocking()
+{
+#ifdef __MINGW32__
+    u_long enabled = 1;
+    return ioctlsocket(fd, FIONBIO, &enabled) == 0;
+#else
+    int flags = fcntl(fd, F_GETFL);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+#endif
+}
+
 void onReadable()
 {
 }
@@ -96,4 +232,3 @@ void onWrititable()
 void onException()
 {
 }
-
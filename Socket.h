@@ -1,8 +1,15 @@
 #ifndef SOCKET_H_INCLUDED
 #define SOCKET_H_INCLUDED
 
+#include "TimerWheel.h"
 #include <vector>
 
+// Use epoll(7) where available, unless the select() fallback is requested
+// explicitly by compiling with -DUSE_SELECT.
+#if defined(__linux__) && !defined(USE_SELECT)
+#define USE_EPOLL
+#endif
+
 enum SelectMask { readable = 1, writable = 2, exception = 4 };
 
 class Socket;
@@ -10,31 +17,59 @@ class Socket;
 class SocketSet
 {
     std::vector<Socket*> sockets;
+    TimerWheel m_timers;
+#ifdef USE_EPOLL
+    int epoll_fd;
+#endif
 
 public:
+    SocketSet();
+    ~SocketSet();
+
     void addSocket(Socket &socket);
+    void updateSocket(Socket &socket);
     void removeSocket(Socket &socket);
     bool process(int timeout_ms = 50);
+
+    inline TimerWheel &timers() { return m_timers; }
 };
 
-class Socket
+// A socket registered with a socket set. Its timer (see setTimer()) is
+// run by the same set.
+class Socket : public Timer
 {
     friend class SocketSet;
 
+    int m_mask;
+
 protected:
-    int fd, mask;
+    int fd;
     SocketSet &m_set;
 
     virtual void onReadable() { };
     virtual void onWritable() { };
     virtual void onException() { };
 
+    inline void setMask(int mask);
+    inline void setTimer(unsigned long ms) { m_set.timers().schedule(*this, ms); }
+    bool setNonBlocking();
+
 public:
     Socket(SocketSet &set, int fd, int mask = readable|writable|exception);
     virtual ~Socket();
 
     inline int file() { return fd; }
+    inline int mask() { return m_mask; }
     inline SocketSet &set() { return m_set; }
 };
 
+void Socket::setMask(int mask)
+{
+    if(mask != m_mask)
+    {
+        m_mask = mask;
+        m_set.updateSocket(*this);
+    }
+}
+
 #endif /* ndef SOCKET_H_INCLUDED */
@@ -0,0 +1,75 @@
+#include "SuperSeeder.h"
+
+SuperSeeder::SuperSeeder(unsigned pieces)
+    : availability(pieces), announced(pieces), offered(pieces),
+      peers(0), next_piece(0)
+{
+}
+
+void SuperSeeder::addPeer()
+{
+    omni_mutex_lock l(mutex);
+    ++peers;
+}
+
+// Called when a peer disconnects, with the pieces it had
+void SuperSeeder::removePeer(const std::vector<bool> &pieces)
+{
+    omni_mutex_lock l(mutex);
+    --peers;
+    for(size_t n = 0; n < pieces.size(); ++n)
+    {
+        if(pieces[n])
+            --availability[n];
+    }
+}
+
+// Records that a peer has a piece; announce is set if it told us with a
+// have message (rather than a bitfield when it connected).
+void SuperSeeder::peerHas(unsigned piece, bool announce)
+{
+    omni_mutex_lock l(mutex);
+    ++availability[piece];
+    if(announce)
+        ++announced[piece];
+}
+
+// Returns whether a piece downloaded by a peer has been seen at another
+// peer (or whether there is no other peer to pass it to).
+bool SuperSeeder::propagated(unsigned piece)
+{
+    omni_mutex_lock l(mutex);
+    return announced[piece] >= 2 || peers == 1;
+}
+
+// Chooses a piece to offer to a peer that has the given pieces: the one
+// that is least available and least offered. Returns -1 if the peer has
+// every piece.
+int SuperSeeder::choosePiece(const std::vector<bool> &pieces)
+{
+    omni_mutex_lock l(mutex);
+
+    int best = -1;
+    unsigned best_score = 0, count = availability.size();
+    for(unsigned n = 0; n < count; ++n)
+    {
+        unsigned piece = (next_piece + n)%count;
+        if(pieces[piece])
+            continue;
+        unsigned score = availability[piece] + offered[piece];
+        if(best < 0 || score < best_score)
+        {
+            best = piece;
+            best_score = score;
+            if(score == 0)
+                break;
+        }
+    }
+
+    if(best >= 0)
+    {
+        ++offered[best];
+        next_piece = (best + 1)%count;
+    }
+    return best;
+}
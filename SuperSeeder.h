@@ -0,0 +1,32 @@
+#ifndef SUPERSEEDER_H_INCLUDED
+#define SUPERSEEDER_H_INCLUDED
+
+#include "RefCountingObject.h"
+#include <omnithread.h>
+#include <vector>
+
+// Shared state for super-seeding a torrent (BEP 16). The seeder pretends
+// to have no pieces and offers each peer one piece at a time, preferring
+// pieces that are rare in the swarm. A peer is offered a new piece only
+// once its previous piece has been seen at another peer, so that pieces
+// are uploaded by the swarm instead of by us.
+class SuperSeeder : public RefCountingObject
+{
+    omni_mutex mutex;
+    std::vector<unsigned> availability;     // connected peers with the piece
+    std::vector<unsigned> announced;        // have messages for the piece
+    std::vector<unsigned> offered;          // times the piece was offered
+    unsigned peers, next_piece;
+
+public:
+    SuperSeeder(unsigned pieces);
+
+    void addPeer();
+    void removePeer(const std::vector<bool> &pieces);
+
+    void peerHas(unsigned piece, bool announce);
+    bool propagated(unsigned piece);
+    int choosePiece(const std::vector<bool> &pieces);
+};
+
+#endif /* ndef SUPERSEEDER_H_INCLUDED */
@@ -0,0 +1,174 @@
+#include "TimerWheel.h"
+#include <sys/time.h>
+#include <time.h>
+
+// Length of a tick (in milliseconds)
+static const unsigned tick_ms = 10;
+
+Timer::Timer() : wheel(NULL), next(NULL), pprev(NULL), expires(0)
+{
+}
+
+Timer::~Timer()
+{
+    disarm();
+}
+
+void Timer::disarm()
+{
+    if(wheel)
+        wheel->remove(*this);
+}
+
+TimerWheel::TimerWheel() : current(0), start(now()), count(0)
+{
+    for(int level = 0; level < levels; ++level)
+        for(int slot = 0; slot < slots; ++slot)
+            wheel[level][slot] = NULL;
+}
+
+// Returns the time in milliseconds, from a clock that is not affected by
+// changes to the system time where possible.
+unsigned long long TimerWheel::now()
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    if(clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+        return 1000ull*ts.tv_sec + ts.tv_nsec/1000000;
+#endif
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return 1000ull*tv.tv_sec + tv.tv_usec/1000;
+}
+
+// Adds a timer to the slot for its expiry tick
+void TimerWheel::insert(Timer &timer)
+{
+    Timer **slot;
+    long delta = long(timer.expires - current);
+    if(delta < 0)
+    {
+        // Overdue; expire at the next tick
+        slot = &wheel[0][current & (slots - 1)];
+    }
+    else
+    {
+        int level = 0;
+        while( level < levels - 1 &&
+               (unsigned long)delta >> (slot_bits*(level + 1)) != 0 )
+            ++level;
+        if((unsigned long)delta >> (slot_bits*(level + 1)) != 0)
+            timer.expires = current + (1ul << (slot_bits*levels)) - 1;
+        slot = &wheel[level][(timer.expires >> (slot_bits*level)) & (slots - 1)];
+    }
+
+    timer.next = *slot;
+    if(timer.next)
+        timer.next->pprev = &timer.next;
+    timer.pprev = slot;
+    *slot = &timer;
+    timer.wheel = this;
+}
+
+void TimerWheel::remove(Timer &timer)
+{
+    *timer.pprev = timer.next;
+    if(timer.next)
+        timer.next->pprev = timer.pprev;
+    timer.wheel = NULL;
+    --count;
+}
+
+// Moves the timers in the current slot of the given level to finer slots.
+// Returns the index of that slot.
+int TimerWheel::cascade(int level)
+{
+    int index = (current >> (slot_bits*level)) & (slots - 1);
+    Timer *timer = wheel[level][index];
+    wheel[level][index] = NULL;
+    while(timer)
+    {
+        Timer *next = timer->next;
+        insert(*timer);
+        timer = next;
+    }
+    return index;
+}
+
+// Arms a timer to expire after the given number of milliseconds
+void TimerWheel::schedule(Timer &timer, unsigned long ms)
+{
+    if(timer.wheel)
+        timer.wheel->remove(timer);
+    timer.expires = (now() - start + ms + tick_ms - 1)/tick_ms;
+    insert(timer);
+    ++count;
+}
+
+// Returns the time (in milliseconds) until the first timer expires, or
+// max_ms if that is sooner (or if max_ms is negative and no timers are
+// armed). Timers in coarse slots are accounted for when they are moved.
+int TimerWheel::timeout(int max_ms) const
+{
+    if(count == 0)
+        return max_ms;
+
+    unsigned long ticks = (unsigned long)-1;
+    for(unsigned long n = 0; n < slots; ++n)
+        if(wheel[0][(current + n) & (slots - 1)])
+        {
+            ticks = n;
+            break;
+        }
+    for(int level = 1; level < levels; ++level)
+    {
+        unsigned long pos = current >> (slot_bits*level);
+        for(unsigned long n = 0; n <= slots; ++n)
+        {
+            unsigned long tick = (pos + n) << (slot_bits*level);
+            if(long(tick - current) >= 0 && wheel[level][(pos + n) & (slots - 1)])
+            {
+                if(tick - current < ticks)
+                    ticks = tick - current;
+                break;
+            }
+        }
+    }
+
+    long long ms = (long long)(start + (current + ticks)*tick_ms) - (long long)now();
+    if(ms < 0)
+        ms = 0;
+    return max_ms >= 0 && ms > max_ms ? max_ms : int(ms);
+}
+
+// Calls onTimeout() for all timers that have expired
+void TimerWheel::run()
+{
+    unsigned long target = (now() - start)/tick_ms;
+    if(count == 0)
+    {
+        current = target + 1;
+        return;
+    }
+
+    while(long(target - current) >= 0)
+    {
+        int index = current & (slots - 1);
+        if(index == 0 && cascade(1) == 0 && cascade(2) == 0)
+            cascade(3);
+        ++current;
+
+        // Expired timers are unlinked before their handler is called, since
+        // it may rearm, cancel or delete any timer (including its own).
+        Timer *expired = wheel[0][index];
+        wheel[0][index] = NULL;
+        if(expired)
+            expired->pprev = &expired;
+        while(expired)
+        {
+            Timer &timer = *expired;
+            remove(timer);
+            timer.onTimeout();
+        }
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef TIMERWHEEL_H_INCLUDED
+#define TIMERWHEEL_H_INCLUDED
+
+#include <cstddef>
+
+class TimerWheel;
+
+// A timer that calls onTimeout() once when it expires. Timers are armed
+// with TimerWheel::schedule(); arming an armed timer reschedules it.
+class Timer
+{
+    friend class TimerWheel;
+
+    TimerWheel *wheel;          // wheel the timer is armed in (or NULL)
+    Timer *next, **pprev;       // position in a slot of the wheel
+    unsigned long expires;      // tick at which the timer expires
+
+protected:
+    virtual void onTimeout() { };
+
+public:
+    Timer();
+    virtual ~Timer();
+
+    inline bool armed() const { return wheel != NULL; }
+    void disarm();
+};
+
+// A hierarchical timing wheel (as described by Varghese and Lauck). Timers
+// due within 64 ticks are kept in a slot per tick; later timers are kept
+// in coarser slots, and moved to finer ones as their time approaches.
+// Arming and cancelling timers takes constant time.
+class TimerWheel
+{
+    friend class Timer;
+
+    enum { levels = 4, slot_bits = 6, slots = 1 << slot_bits };
+
+    Timer *wheel[levels][slots];
+    unsigned long current;      // next tick to process
+    unsigned long long start;   // time of tick 0 (in milliseconds)
+    unsigned count;             // number of armed timers
+
+    static unsigned long long now();
+
+    void insert(Timer &timer);
+    void remove(Timer &timer);
+    int cascade(int level);
+
+public:
+    TimerWheel();
+
+    void schedule(Timer &timer, unsigned long ms);
+    int timeout(int max_ms) const;
+    void run();
+};
+
+#endif /* ndef TIMERWHEEL_H_INCLUDED */
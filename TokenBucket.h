@@ -0,0 +1,67 @@
+#ifndef TOKENBUCKET_H_INCLUDED
+#define TOKENBUCKET_H_INCLUDED
+
+#include <sys/time.h>
+#include <cstddef>
+
+// Limits a transfer rate. Tokens (bytes) accumulate continuously at the
+// given rate, up to a tenth of a second's worth, and are spent as data is
+// written. A rate of zero means unlimited.
+class TokenBucket
+{
+    unsigned m_rate;
+    double tokens, burst;
+    unsigned long long last_refill;     // microseconds
+
+    inline static unsigned long long now();
+
+public:
+    inline TokenBucket(unsigned rate = 0);
+
+    inline unsigned rate() const { return m_rate; }
+    inline bool limited() const { return m_rate != 0; }
+    inline size_t available();
+    inline void consume(size_t bytes);
+};
+
+// Minimum burst size; writes smaller than this are inefficient
+static const double min_burst_size = 16384;
+
+unsigned long long TokenBucket::now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return 1000000ull*tv.tv_sec + tv.tv_usec;
+}
+
+TokenBucket::TokenBucket(unsigned rate)
+    : m_rate(rate), tokens(0), burst(rate/10.0), last_refill(now())
+{
+    if(burst < min_burst_size)
+        burst = min_burst_size;
+}
+
+// Returns the number of bytes that may be written now
+size_t TokenBucket::available()
+{
+    if(!limited())
+        return size_t(-1);
+
+    unsigned long long t = now();
+    if(t > last_refill)
+    {
+        tokens += m_rate*1e-6*(t - last_refill);
+        if(tokens > burst)
+            tokens = burst;
+    }
+    last_refill = t;
+    return size_t(tokens);
+}
+
+void TokenBucket::consume(size_t bytes)
+{
+    if(limited())
+        tokens -= bytes;
+}
+
+#endif /* ndef TOKENBUCKET_H_INCLUDED */
@@ -55,10 +55,10 @@ typedef std::map<std::string, time_t> FileModMap;
 
 TorrentDirectory::TorrentDirectory(
     TorrentTracker &tracker, const char *data_dir, const char *metadata_dir,
-    const std::string &announce_url )
+    const std::vector<std::string> &announce_urls, const std::string &web_seed_url )
     : tracker(tracker),
       data_dir(realPath(data_dir)), metadata_dir(realPath(metadata_dir)),
-      announce_url(announce_url), single_dir(data_dir == metadata_dir)
+      web_seed_url(web_seed_url), announce_urls(announce_urls), single_dir(data_dir == metadata_dir)
 {
 }
 
@@ -181,7 +181,8 @@ bool TorrentDirectory::update(unsigned cooldown)
             std::cerr << "\tgenerating " << mi_path << std::endl;
 #endif
             // Regenerate metadata info
-            mi = MetaInfo::generate(data_dir + '/' + i->first, announce_url);
+            mi = MetaInfo::generate( data_dir + '/' + i->first,
+                                     announce_urls, web_seed_url );
 
             if(mi)
                 mi->toPath(mi_path.c_str());
@@ -198,6 +199,9 @@ bool TorrentDirectory::update(unsigned cooldown)
         if(mi)
         {
             // Register it.
+            mi->dataPath(data_dir + '/' + i->first);
+            mi->superSeeding( cfg_super_seeding ||
+                isFile((metadata_dir + "/." + i->first + ".superseed").c_str()) );
             tracker.addTorrent(mi, true);
             current[i->first] = mi;
         }
@@ -3,19 +3,22 @@
 
 #include "TorrentTracker.h"
 #include <string>
+#include <vector>
 
 class TorrentDirectory
 {
     TorrentTracker &tracker;
     MetaInfoMap current;
-    std::string data_dir, metadata_dir, announce_url;
+    std::string data_dir, metadata_dir, web_seed_url;
+    std::vector<std::string> announce_urls;
     bool single_dir;
 
 public:
     TorrentDirectory(
         TorrentTracker &tracker,
         const char *data_dir, const char *metadata_dir,
-        const std::string &announce );
+        const std::vector<std::string> &announce,
+        const std::string &web_seed = "" );
     ~TorrentDirectory();
 
     bool update(unsigned cooldown);
@@ -1,12 +1,19 @@
 #include "TorrentPeer.h"
+#include "settings.h"
+#include "sha.h"
 #ifdef __MINGW32__
 #include <winsock.h>
 #define read(fd,buf,len) recv(fd,buf,len,0)
 #define write(fd,buf,len) send(fd,buf,len,0)
 #else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <fcntl.h>
 #include <unistd.h>
 #endif
+#include <cerrno>
 #include <cstdio>
+#include <cstring>
 #include <algorithm>
 
 #ifdef DEBUG
@@ -15,31 +22,42 @@
 #define INFO(x) ;
 #endif
 
-inline bool operator== (const Request &r, const Request &s)
-{
-    return r.piece == s.piece &&
-           r.begin == s.begin &&
-           r.length == s.length;
-}
-
-inline bool operator< (const Request &r, const Request &s)
+// Maximum number of requests a peer may have in queue
+static const unsigned max_requests = 1000;
+
+// Maximum number of bytes of adjacent requests read at once
+static const unsigned max_run_length = 128*1024;
+
+// Size of the receive buffer; it only grows for messages that do not fit.
+static const unsigned input_buffer_size = 65536;
+
+// Maximum length of a message
+static const unsigned max_message_length = 1<<18;
+
+// Note: the connection must have been admitted by TorrentSeeder::admitPeer()
+TorrentPeer::TorrentPeer(SeederThread &thread, int fd, unsigned address)
+    : Socket(thread.set(), fd, readable|exception),
+    thread(thread), server(thread.seeder()),
+    info(0), m_address(address), input_begin(0), input_end(0), waiting_for(handshake),
+    pending_reads(0), pending_bytes(0), backlog(0), draining(false),
+    closed(false), fast(false),
+    choking(true), peer_interested(false),
+    upload_bucket(cfg_upload_rate_per_peer), super_seeder(NULL),
+    awaited_piece(-1)
 {
-    return ( r.piece < s.piece || r.piece == s.piece &&
-           ( r.begin < s.begin || r.begin == s.begin &&
-           ( r.length <= s.length ) ) );
-}
+    last_received = last_sent = std::time(NULL);
+    if(cfg_handshake_timeout)
+        setTimer(1000ul*cfg_handshake_timeout);
 
+#ifndef HAVE_ACCEPT4
+    setNonBlocking();   // otherwise done by accept4()
+#endif
 
-// Maximum number of requests a peer may have in queue
-static const int max_requests = 1000;
+    next_request.piece  = 0;
+    next_request.begin  = 0;
+    next_request.length = 0;
 
-TorrentPeer::TorrentPeer(TorrentSeeder &server, int fd)
-    : Socket(server.set(), fd, readable|exception), server(server),
-    info(0), input_pos(0), output_pos(0), waiting_for(handshake),
-    piece_index(unsigned(-1))
-{
-    // Prepare to receive 48-byte handshake
-    input.resize(20 + 8 + 20);
+    input.resize(input_buffer_size);
 
     INFO("constructed");
 }
@@ -47,32 +65,65 @@ TorrentPeer::TorrentPeer(TorrentSeeder &server, int fd)
 TorrentPeer::~TorrentPeer()
 {
     INFO("destructed");
-    info->release();
-    server.removePeer(*this);
+    if(super_seeder)
+    {
+        super_seeder->removePeer(peer_pieces);
+        super_seeder->release();
+    }
+    if(info)
+    {
+        server.releaseTorrentPeer(info->infohash());
+        info->release();
+    }
+    if(!closed)
+        thread.removePeer(*this);
+    server.releaseOutput(backlog);
+    server.releasePeer(m_address);
 }
 
 void TorrentPeer::destroy()
 {
-    delete this;
+    if(pending_reads == 0)
+    {
+        delete this;
+        return;
+    }
+
+    // Disk reads still refer to this peer; close the connection now and
+    // delete the peer when the last read completes.
+    if(!closed)
+    {
+        closed = true;
+        disarm();
+        set().removeSocket(*this);
+        shutdown(fd, 2);
+        thread.removePeer(*this);
+        requests.clear();
+    }
 }
 
 void TorrentPeer::onReadable()
 {
     INFO("readable");
 
-    ssize_t bytes = read(fd, &input[input_pos], input.size() - input_pos);
+    // Read as much as is available; processInput() guarantees there is
+    // room for at least one byte.
+    ssize_t bytes = read(fd, &input[input_end], input.size() - input_end);
 
     if(bytes > 0)
     {
         // DEBUG
-        //hexdump(std::cout, &input[input_pos], bytes) << std::endl;
+        //hexdump(std::cout, &input[input_end], bytes) << std::endl;
 
-        input_pos += bytes;
-        if(input_pos >= input.size())
-        {
-            processInput();
-            input_pos = 0;
-        }
+        last_received = std::time(NULL);
+        input_end += bytes;
+        if(processInput())
+            queueRequests();
+    }
+    else
+    if(bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    {
+        // No data available yet
     }
     else
     {
@@ -86,33 +137,38 @@ void TorrentPeer::onWritable()
 {
     INFO("writable");
 
-    if(!output.empty())
+    size_t limit = thread.uploadAllowance(*this);
+    if(limit == 0)
     {
-        ssize_t bytes = write( fd, &output.front()[output_pos],
-                                   output.front().size() - output_pos );
-
-        if(bytes < 0)
-        {
-            // Write error
-            perror("write");
-            destroy();
-        }
-        else
-        {
-            // DEBUG
-            //hexdump(std::cout, &output.front()[output_pos], bytes) << std::endl;
+        setMask(mask() & ~writable);
+        thread.throttle(*this);
+        return;
+    }
 
-            output_pos += bytes;
-            if(output_pos >= output.front().size())
-            {
-                output.pop();
-                output_pos = 0;
-            }
-        }
+    size_t queued = output.size();
+    if(!output.flush(fd, limit))
+    {
+        // Write error
+        perror("write");
+        destroy();
+        return;
     }
+    size_t written = queued - output.size();
+    if(written > 0)
+        last_sent = std::time(NULL);
+    upload_rate.add(written);
+    thread.chargeUpload(*this, written);
 
     if(output.empty())
-        mask &= ~writable;
+        setMask(mask() & ~writable);
+    queueRequests();
+}
+
+// Called by the thread when a throttled peer may write again
+void TorrentPeer::resumeWriting()
+{
+    if(!output.empty())
+        setMask(mask() | writable);
 }
 
 void TorrentPeer::onException()
@@ -126,9 +182,9 @@ std::ostream& TorrentPeer::_info()
     return std::cerr << "TorrentPeer(" << fd << "): ";
 }
 
-inline static unsigned parse_int(const ByteBuffer &buffer, int pos)
+inline static unsigned parse_int(const Byte *buffer, int pos)
 {
-    unsigned char *b = (unsigned char*)&buffer[pos];
+    const unsigned char *b = (const unsigned char*)&buffer[pos];
     return (b[0] << 24) | (b[1] << 16) | (b[2] <<  8) | (b[3]);
 }
 
@@ -142,193 +198,570 @@ inline void append_int(ByteBuffer &buffer, int i)
     buffer[pos + 3] = Byte(i>> 0);
 }
 
-void TorrentPeer::processInput()
+inline static void put_int(Byte *p, unsigned i)
+{
+    p[0] = Byte(i>>24);
+    p[1] = Byte(i>>16);
+    p[2] = Byte(i>> 8);
+    p[3] = Byte(i>> 0);
+}
+
+// Processes all complete messages in the input buffer. Returns false if
+// the peer was destroyed.
+bool TorrentPeer::processInput()
 {
-    switch(waiting_for)
+    while(!closed)
     {
-    case handshake:
+        const Byte *frame = &input[input_begin];
+        unsigned available = input_end - input_begin, needed = 0;
+
+        switch(waiting_for)
         {
-            const char *bittorrent = "\23BitTorrent protocol";
-            std::string protocol(&input[0], 20);
-            if(protocol != bittorrent)
+        case handshake:
+            needed = 20 + 8 + 20;
+            if(available >= needed)
             {
-                INFO("invalid protocol id: " << protocol);
-                destroy();
-                return;
+                const char *bittorrent = "\23BitTorrent protocol";
+                std::string protocol(frame, 20);
+                if(protocol != bittorrent)
+                {
+                    INFO("invalid protocol id: " << protocol);
+                    destroy();
+                    return false;
+                }
+
+                std::string infohash(frame + 28, 20);
+                if(!server.admitTorrentPeer(infohash))
+                {
+                    INFO("too many peers for torrent");
+                    destroy();
+                    return false;
+                }
+                info = server.acquireMetaInfo(infohash);
+                if(info == NULL)
+                {
+                    INFO("unknow infohash");
+                    server.releaseTorrentPeer(infohash);
+                    destroy();
+                    return false;
+                }
+
+                // Fast Extension is enabled if both sides set its bit
+                fast = (frame[20 + 7] & 0x04) != 0;
+
+                ByteBuffer data;
+                // Protocol version
+                data.insert(data.end(), bittorrent, bittorrent + 20);
+                // 8 reserved bytes
+                data.insert(data.end(), 7, 0);
+                data.push_back(0x04);
+                // Add metainfo hash
+                data.insert(data.end(), infohash.data(), infohash.data() + 20);
+                // Send local peer id
+                data.insert(data.end(), server.id().data(), server.id().data() + 20);
+                queueOutput(data);
+
+                super_seeder = server.acquireSuperSeeder(infohash);
+                if(super_seeder)
+                {
+                    // Pretend to have nothing, and offer a single piece
+                    super_seeder->addPeer();
+                    peer_pieces.assign(info->pieces(), false);
+                    if(fast)
+                        queueMessage(have_none);
+                    superSeed();
+                }
+                else
+                if(fast)
+                {
+                    queueMessage(have_all);
+                    queueAllowedFast();
+                }
+                else
+                {
+                    // Add 'bitfield' message
+                    data.clear();
+                    int pieces = info->pieces();
+                    append_int(data, 1 + pieces/8 + (pieces%8 == 0 ? 0 : 1));
+                    queueOutput(data);
+                    data.clear();
+                    data.push_back(bitfield);
+                    data.insert(data.end(), pieces/8, 255);
+                    if(pieces%8)
+                        data.push_back(~char((1<<(8 - pieces%8))-1));
+                    queueOutput(data);
+                }
+
+                // Peers are unchoked by their thread once they are interested
+
+                waiting_for = identifier;
+
+                INFO("handshake succesful");
             }
+            break;
 
-            std::string infohash(&input[28], 20);
-            info = server.getMetaInfo(infohash);
-            if(info == NULL)
+        case identifier:
+            needed = 20;
+            if(available >= needed)
             {
-                INFO("unknow infohash");
-                destroy();
-                return;
+                INFO("peer id received");
+                waiting_for = message;
+                armTimer();
             }
-            info->acquire();
-
-            ByteBuffer data;
-            // Protocol version
-            data.insert(data.end(), bittorrent, bittorrent + 20);
-            // 8 reserved bytes
-            data.insert(data.end(), 8, 0);
-            // Add metainfo hash
-            data.insert(data.end(), infohash.data(), infohash.data() + 20);
-            // Send local peer id
-            data.insert(data.end(), server.id().data(), server.id().data() + 20);
-            queueOutput(data);
-
-            // Add 'bitfield' message
-            data.clear();
-            int pieces = info->pieces();
-            append_int(data, 1 + pieces/8 + (pieces%8 == 0 ? 0 : 1));
-            queueOutput(data);
-            data.clear();
-            data.push_back(bitfield);
-            data.insert(data.end(), pieces/8, 255);
-            if(pieces%8)
-                data.push_back(~char((1<<(8 - pieces%8))-1));
-            queueOutput(data);
-
-            // Add 'unchoke' message
-            queueMessage(unchoke);
-
-            // Set output buffer!
-
-            // Set input buffer
-            input.resize(20);
-            waiting_for = identifier;
-
-            INFO("handshake succesful");
-        } break;
-
-    case identifier:
-        {
-            INFO("peer id received");
-            input.resize(4);
-            waiting_for = length;
-        } break;
+            break;
 
-    case length:
-        {
-            unsigned length = parse_int(input, 0);
-            if(length > (1<<18))
+        case message:
+            needed = 4;
+            if(available >= needed)
             {
-                INFO("message of length " << length << " too large");
-                destroy();
-                return;
+                unsigned length = parse_int(frame, 0);
+                if(length > max_message_length)
+                {
+                    INFO("message of length " << length << " too large");
+                    destroy();
+                    return false;
+                }
+                needed += length;
+                if(available >= needed)
+                    processMessage(frame + 4, length);
             }
-            if(length == 0)
+            break;
+        }
+
+        if(available < needed)
+        {
+            // Move the incomplete message to the front of the buffer, making
+            // room for the rest of it.
+            if(input_begin + needed > input.size())
             {
-                // Empty message
-                processMessage(ByteBuffer());
+                std::copy( input.begin() + input_begin, input.begin() + input_end,
+                           input.begin() );
+                input_end -= input_begin;
+                input_begin = 0;
+                if(needed > input.size())
+                    input.resize(needed);
             }
-            else
-            {
-                input.resize(length);
-                waiting_for = message;
-            }
-        } break;
+            break;
+        }
 
-    case message:
-        {
-            processMessage(input);
-            input.resize(4);
-            waiting_for = length;
-        } break;
+        input_begin += needed;
+        if(input_begin == input_end)
+            input_begin = input_end = 0;
     }
+    return !closed;
 }
 
-void TorrentPeer::processMessage(const ByteBuffer &message)
+void TorrentPeer::processMessage(const Byte *message, unsigned size)
 {
-    if(message.size() == 0)
+    if(size == 0)
     {
         INFO("Keep-alive received");
         return;
     }
 
-    INFO("Message received: " << int(message[0]) << " (" << message.size() - 1 << " additional bytes)");
+    INFO("Message received: " << int(message[0]) << " (" << size - 1 << " additional bytes)");
 
     switch(message[0])
     {
+    case interested:
+    case not_interested:
+        if(peer_interested != (message[0] == interested))
+        {
+            peer_interested = !peer_interested;
+            thread.peerInterested(*this, peer_interested);
+        }
+        break;
+
+    case have:
+        if(super_seeder && size == 5)
+        {
+            unsigned piece = parse_int(message, 1);
+            if(piece < info->pieces())
+            {
+                peerHas(piece, true);
+                superSeed();
+            }
+        }
+        break;
+
+    case bitfield:
+        if(super_seeder && size - 1 == (info->pieces() + 7)/8)
+        {
+            for(unsigned piece = 0; piece < info->pieces(); ++piece)
+            {
+                if(message[1 + piece/8] & (0x80 >> piece%8))
+                    peerHas(piece, false);
+            }
+            superSeed();
+        }
+        break;
+
+    case have_all:
+        if(super_seeder && fast)
+        {
+            for(unsigned piece = 0; piece < info->pieces(); ++piece)
+                peerHas(piece, false);
+        }
+        break;
+
     case request:
-        if(message.size() == 13)
+        if(size == 13)
         {
             Request r = {
                 parse_int(message, 1),      // piece
                 parse_int(message, 5),      // begin
                 parse_int(message, 9) };    // length
-            if(info->validRequest(r.piece, r.begin, r.length))
+            if( info->validRequest(r.piece, r.begin, r.length) &&
+                (!choking || allowedFast(r.piece)) &&
+                ( super_seeder == NULL || std::find( offered_pieces.begin(),
+                      offered_pieces.end(), r.piece ) != offered_pieces.end() ) )
             {
                 INFO("Received request for piece " << r.piece << " [" << r.begin << ',' << r.begin + r.length << ")");
-                while(int(requests.size()) >= max_requests)
-                    requests.pop_front();
-                requests.push_back(r);
+                if(requests.size() < max_requests)
+                    requests.insert(r);
+                else
+                    queueReject(r);
             }
+            else
+                queueReject(r);
         }
         break;
 
     case cancel:
-        if(message.size() == 13)
+        if(size == 13)
         {
             Request r = {
                 parse_int(message, 1),      // piece
                 parse_int(message, 5),      // begin
                 parse_int(message, 9) };    // length
-            std::deque<Request>::iterator i = std::find(requests.begin(), requests.end(), r);
-            if(i != requests.end())
+            if(requests.erase(r) > 0)
             {
                 INFO("Canceled request for piece " << r.piece << " [" << r.begin << ',' << r.begin + r.length << ")");
-                requests.erase(i);
+                queueReject(r);
             }
         }
         break;
     }
 }
 
-unsigned TorrentPeer::queueRequest()
+// Reads the next run of adjacent requests. Requests are served in the
+// order of their position in the torrent, continuing after the last one
+// served, so that the disk reads sequentially and each piece is visited
+// once per pass.
+void TorrentPeer::queueRequest()
 {
     if(requests.empty())
-        return 0;
+        return;
+
+    std::set<Request>::iterator i = requests.lower_bound(next_request);
+    if(i == requests.end())
+        i = requests.begin();
 
-    const Request &r = requests.front();
-    if(r.piece != piece_index)
+    // Read data on a disk thread; completeRead() queues the result.
+#ifdef HAVE_SENDFILE
+    BlockRead *read = new BlockRead(*this, cfg_upload_sendfile != 0);
+#else
+    BlockRead *read = new BlockRead(*this, false);
+#endif
+    unsigned length = 0;
+    do {
+        read->requests.push_back(*i);
+        length += i->length;
+        requests.erase(i++);
+    } while( i != requests.end() && i->piece == read->piece() &&
+             i->begin == read->begin() + length &&
+             length + i->length <= max_run_length );
+
+    next_request.piece  = read->piece();
+    next_request.begin  = read->begin() + length;
+    next_request.length = 0;
+
+    ++pending_reads;
+    pending_bytes += length;
+    server.diskIO().submit(read);
+}
+
+// Updates the backlog (bytes queued for output or being read) and
+// reports the change to the seeder
+void TorrentPeer::updateBacklog()
+{
+    size_t bytes = output.size() + pending_bytes;
+    if(bytes > backlog)
+        server.reserveOutput(bytes - backlog);
+    else
+        server.releaseOutput(backlog - bytes);
+    backlog = bytes;
+}
+
+// Starts reading requested data, as long as the peer's backlog is small.
+// Writes are paced by the rate limits, so reads only need to stay ahead.
+// Once the backlog reaches the high watermark, no data is read until it
+// has drained below the low watermark. If all peers together have too
+// much data queued, the thread retries later.
+void TorrentPeer::queueRequests()
+{
+    updateBacklog();
+    if(draining && backlog < cfg_peer_output_low)
+        draining = false;
+
+    bool queued = false;
+    while(!requests.empty() && !draining && !closed)
     {
-        if(!info->fetchPiece(r.piece, piece_data))
+        if(backlog >= cfg_peer_output_high)
+        {
+            draining = true;
+            break;
+        }
+        if(!server.outputAvailable())
         {
-            INFO("Unable to fetch piece " << r.piece << "!");
-            requests.pop_front();
-            return 0;
+            thread.deferRequests(*this);
+            break;
         }
-        piece_index = r.piece;
+        queueRequest();
+        updateBacklog();
+        queued = true;
     }
+    if(queued)
+        server.diskIO().flush();
+}
 
-    if(r.begin + r.length > piece_data.size())
+// Called on this peer's thread when a disk read has finished
+void TorrentPeer::completeRead(BlockRead &read)
+{
+    --pending_reads;
+    pending_bytes -= read.length();
+    if(closed)
+    {
+        if(pending_reads == 0)
+            delete this;
+        return;
+    }
+
+    if(!read.ok)
+    {
+        INFO("Unable to read data for piece " << read.piece() << " [" << read.begin() << ',' << read.begin() + read.length() << ")");
+        for(size_t n = 0; n < read.requests.size(); ++n)
+            queueReject(read.requests[n]);
+    }
+    else
+    if(read.prefetch)
+    {
+        for(size_t n = 0; n < read.requests.size(); ++n)
+        {
+            if(!queueFileData(read.requests[n]))
+            {
+                INFO("Unable to map request for piece " << read.piece() << "!");
+                queueReject(read.requests[n]);
+            }
+        }
+    }
+    else
     {
-        INFO( "Unable to satisfy request for short piece "
-              << r.piece << " of length " << piece_data.size() );
-        requests.pop_front();
-        return 0;
+        INFO("Queueing data for piece " << read.piece() << " [" << read.begin() << ',' << read.begin() + read.length() << ")");
+        queueOutput(read.data);
     }
+    queueRequests();
+}
 
-    INFO("Queueing data for piece " << r.piece << " [" << r.begin << ',' << r.begin + r.length << ")");
+// Writes the 13-byte header of the piece message for a request
+static void put_piece_header(Byte *header, const Request &r)
+{
+    put_int(header, 1 + 8 + r.length);
+    header[4] = ::piece;
+    put_int(header + 5, r.piece);
+    put_int(header + 9, r.begin);
+}
 
-    ByteBuffer data;
-    data.reserve(4 + 1 + 8 + r.length);
-    append_int(data, 1 + 8 + r.length);
-    data.push_back(::piece);
-    append_int(data, r.piece);
-    append_int(data, r.begin);
-    data.insert(data.end(), &piece_data[r.begin], &piece_data[r.begin + r.length]);
+BlockRead::BlockRead(TorrentPeer &peer, bool prefetch)
+    : peer(peer), prefetch(prefetch), ok(false)
+{
+}
+
+void BlockRead::run()
+{
+    const MetaInfo &info = *peer.info;
+
+    if(prefetch)
+    {
+        // Start reading the data into the page cache, so that sendfile()
+        // does not have to wait for the disk.
+        std::vector<MetaInfo::FileExtent> extents;
+        ok = info.fileExtents(piece(), begin(), length(), extents);
+        for(size_t n = 0; ok && n < extents.size(); ++n)
+        {
+            const DataFile *file = info.openFile(extents[n].file);
+            if(file == NULL)
+            {
+                ok = false;
+                break;
+            }
+#ifdef POSIX_FADV_WILLNEED
+            posix_fadvise( file->fd(), extents[n].offset, extents[n].length,
+                           POSIX_FADV_WILLNEED );
+#endif
+            file->release();
+        }
+        return;
+    }
+
+    const PieceData *piece_data = peer.server.pieceCache().fetch(info, piece());
+    if(piece_data == NULL)
+        return;
+
+    if(begin() + length() <= piece_data->data.size())
+    {
+        data.clear();   // may have been prepared for an engine that was full
+        data.reserve(13*requests.size() + length());
+        for(size_t n = 0; n < requests.size(); ++n)
+        {
+            const Request &r = requests[n];
+            data.resize(data.size() + 13);
+            put_piece_header(&data[data.size() - 13], r);
+            data.insert( data.end(), &piece_data->data[r.begin],
+                         &piece_data->data[r.begin] + r.length );
+        }
+        ok = true;
+    }
+    piece_data->release();
+}
+
+// Describes the reads needed for the run, which is read from disk in one
+// piece (bypassing the piece cache). Without sendfile(), the data is read
+// into the end of the message buffer; finish() moves each block into place.
+bool BlockRead::prepare(std::vector<DiskRead> &reads)
+{
+    const MetaInfo &info = *peer.info;
+
+    std::vector<MetaInfo::FileExtent> extents;
+    if(!info.fileExtents(piece(), begin(), length(), extents))
+        return false;
+
+    size_t pos = 13*requests.size();
+    if(!prefetch)
+        data.resize(pos + length());
+
+    for(size_t n = 0; n < extents.size(); ++n)
+    {
+        if(extents[n].length == 0)
+            continue;
+
+        DiskRead read;
+        read.file = info.openFile(extents[n].file);
+        if(read.file == NULL)
+        {
+            for(size_t m = 0; m < reads.size(); ++m)
+                reads[m].file->release();
+            reads.clear();
+            data.clear();
+            return false;
+        }
+        read.offset = extents[n].offset;
+        read.data   = prefetch ? NULL : &data[pos];
+        read.length = extents[n].length;
+        reads.push_back(read);
+        pos += extents[n].length;
+    }
+    return true;
+}
+
+void BlockRead::finish(bool ok)
+{
+    this->ok = ok;
+    if(!ok || prefetch)
+        return;
+
+    // Move blocks forward, making room for the message headers. Each block
+    // moves to before the start of the next one, which is still in place.
+    size_t src = 13*requests.size(), dst = 0;
+    for(size_t n = 0; n < requests.size(); ++n)
+    {
+        put_piece_header(&data[dst], requests[n]);
+        dst += 13;
+        if(requests[n].length > 0 && dst != src)
+            std::memmove(&data[dst], &data[src], requests[n].length);
+        src += requests[n].length;
+        dst += requests[n].length;
+    }
+}
+
+void BlockRead::complete()
+{
+    peer.thread.completeRead(this);
+}
+
+// Queues a piece message whose payload is sent directly from the data
+// files, without copying it into user space.
+bool TorrentPeer::queueFileData(const Request &r)
+{
+    std::vector<MetaInfo::FileExtent> extents;
+    if(!info->fileExtents(r.piece, r.begin, r.length, extents))
+        return false;
+
+    INFO("Queueing file data for piece " << r.piece << " [" << r.begin << ',' << r.begin + r.length << ")");
+
+    ByteBuffer data(13);
+    put_piece_header(&data[0], r);
     queueOutput(data);
-    requests.pop_front();
-    return r.length;
+
+    for(size_t n = 0; n < extents.size(); ++n)
+        output.pushFile( info, extents[n].file,
+                         extents[n].offset, extents[n].length );
+    return true;
+}
+
+// Arms the timer for the idle timeout or the next keep-alive message,
+// whichever comes first
+void TorrentPeer::armTimer()
+{
+    std::time_t deadline = 0;
+    if(cfg_peer_timeout)
+        deadline = last_received + cfg_peer_timeout;
+    if( cfg_keep_alive_interval &&
+        (deadline == 0 || last_sent + (std::time_t)cfg_keep_alive_interval < deadline) )
+        deadline = last_sent + cfg_keep_alive_interval;
+
+    if(deadline == 0)
+    {
+        disarm();
+        return;
+    }
+    std::time_t t = std::time(NULL);
+    setTimer(deadline > t ? 1000ul*(deadline - t) : 0);
+}
+
+void TorrentPeer::onTimeout()
+{
+    if(waiting_for != message)
+    {
+        INFO("handshake timed out");
+        destroy();
+        return;
+    }
+
+    std::time_t t = std::time(NULL);
+    if(cfg_peer_timeout && t - last_received >= (std::time_t)cfg_peer_timeout)
+    {
+        INFO("connection timed out");
+        destroy();
+        return;
+    }
+    if(cfg_keep_alive_interval && t - last_sent >= (std::time_t)cfg_keep_alive_interval)
+    {
+        // An empty message keeps the connection alive
+        ByteBuffer data;
+        append_int(data, 0);
+        queueOutput(data);
+        last_sent = t;
+    }
+    armTimer();
 }
 
 void TorrentPeer::queueOutput(const ByteBuffer &data)
 {
+    if(closed)
+        return;
     output.push(data);
-    mask |= writable;
+    setMask(mask() | writable);
 }
 
 void TorrentPeer::queueMessage(MessageType type)
@@ -339,3 +772,134 @@ void TorrentPeer::queueMessage(MessageType type)
     data.push_back(type);
     queueOutput(data);
 }
+
+// Tells a peer supporting the Fast Extension that a request will not be
+// served. Other peers are expected to notice dropped requests themselves.
+void TorrentPeer::queueReject(const Request &r)
+{
+    if(!fast)
+        return;
+
+    ByteBuffer data;
+    data.reserve(4 + 1 + 12);
+    append_int(data, 1 + 12);
+    data.push_back(reject_request);
+    append_int(data, r.piece);
+    append_int(data, r.begin);
+    append_int(data, r.length);
+    queueOutput(data);
+}
+
+// Computes the allowed fast set for this peer as described in BEP 6, and
+// sends it.
+void TorrentPeer::queueAllowedFast()
+{
+    unsigned count = std::min(cfg_allowed_fast, info->pieces());
+    if(count == 0 || m_address == 0)
+        return;
+
+    unsigned ip = m_address & 0xffffff00;
+    std::string x;
+    x += char(ip >> 24);
+    x += char(ip >> 16);
+    x += char(ip >>  8);
+    x += char(ip >>  0);
+    x += info->infohash();
+
+    while(allowed_pieces.size() < count)
+    {
+        x = sha1(x);
+        for(int i = 0; i < 5 && allowed_pieces.size() < count; ++i)
+        {
+            unsigned index = parse_int(x.data(), 4*i) % info->pieces();
+            if( std::find(allowed_pieces.begin(), allowed_pieces.end(), index)
+                == allowed_pieces.end() )
+                allowed_pieces.push_back(index);
+        }
+    }
+
+    for(size_t n = 0; n < allowed_pieces.size(); ++n)
+    {
+        ByteBuffer data;
+        data.reserve(4 + 1 + 4);
+        append_int(data, 1 + 4);
+        data.push_back(allowed_fast);
+        append_int(data, allowed_pieces[n]);
+        queueOutput(data);
+    }
+}
+
+bool TorrentPeer::allowedFast(unsigned piece) const
+{
+    return std::find(allowed_pieces.begin(), allowed_pieces.end(), piece)
+           != allowed_pieces.end();
+}
+
+// Stops serving requests; only requests for allowed fast pieces are kept.
+void TorrentPeer::choke()
+{
+    INFO("choking");
+    choking = true;
+    queueMessage(::choke);
+
+    std::set<Request>::iterator i = requests.begin();
+    while(i != requests.end())
+    {
+        if(fast && allowedFast(i->piece))
+            ++i;
+        else
+        {
+            queueReject(*i);
+            requests.erase(i++);
+        }
+    }
+}
+
+void TorrentPeer::unchoke()
+{
+    INFO("unchoking");
+    choking = false;
+    queueMessage(::unchoke);
+}
+
+// Records that the peer has a piece, for super-seeding
+void TorrentPeer::peerHas(unsigned piece, bool announce)
+{
+    if(peer_pieces[piece])
+        return;
+    peer_pieces[piece] = true;
+    super_seeder->peerHas(piece, announce);
+
+    // A piece the peer already had when it connected was not downloaded
+    // from us, so there is nothing to wait for.
+    if(!announce && int(piece) == awaited_piece)
+        awaited_piece = -1;
+}
+
+// When super-seeding, offers the peer a new piece once it has passed the
+// previously offered piece on to another peer. Called when the peer's
+// pieces change and periodically by the thread.
+void TorrentPeer::superSeed()
+{
+    if(super_seeder == NULL || closed)
+        return;
+
+    if( awaited_piece >= 0 && !( peer_pieces[awaited_piece] &&
+                                 super_seeder->propagated(awaited_piece) ) )
+        return;
+
+    int piece = super_seeder->choosePiece(peer_pieces);
+    awaited_piece = piece;
+    if(piece < 0)
+        return;
+
+    INFO("Offering piece " << piece);
+    offered_pieces.push_back(piece);
+
+    ByteBuffer data;
+    data.reserve(4 + 1 + 4);
+    append_int(data, 1 + 4);
+    data.push_back(have);
+    append_int(data, piece);
+    queueOutput(data);
+}
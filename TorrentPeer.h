@@ -5,8 +5,14 @@
 #include <vector>
 #include <queue>
 #include <deque>
+#include <set>
 #include <iostream>
+#include <ctime>
 
+#include "DiskIO.h"
+#include "OutputQueue.h"
+#include "RateEstimator.h"
+#include "TokenBucket.h"
 #include "Socket.h"
 #include "TorrentSeeder.h"
 
@@ -19,7 +25,14 @@ enum MessageType {
     bitfield        = 5,
     request         = 6,
     piece           = 7,
-    cancel          = 8
+    cancel          = 8,
+
+    // Fast Extension (BEP 6)
+    suggest_piece   = 13,
+    have_all        = 14,
+    have_none       = 15,
+    reject_request  = 16,
+    allowed_fast    = 17
 };
 
 struct Request
@@ -27,43 +40,130 @@ struct Request
     unsigned piece, begin, length;
 };
 
+inline bool operator== (const Request &r, const Request &s)
+{
+    return r.piece == s.piece &&
+           r.begin == s.begin &&
+           r.length == s.length;
+}
+
+// Orders requests by their position in the torrent
+inline bool operator< (const Request &r, const Request &s)
+{
+    return r.piece < s.piece || ( r.piece == s.piece &&
+           ( r.begin < s.begin || ( r.begin == s.begin &&
+             r.length < s.length ) ) );
+}
+
+class TorrentPeer;
+
+// Reads the data for a run of adjacent requests in one piece on a disk
+// thread. When data is sent with sendfile(), it is only prefetched into the
+// page cache; otherwise the complete piece messages are built.
+class BlockRead : public DiskJob
+{
+public:
+    TorrentPeer &peer;
+    std::vector<Request> requests;
+    bool prefetch, ok;
+    ByteBuffer data;
+
+    BlockRead(TorrentPeer &peer, bool prefetch);
+
+    inline unsigned piece() const { return requests.front().piece; }
+    inline unsigned begin() const { return requests.front().begin; }
+    inline unsigned length() const;
+
+    void run();
+    void complete();
+
+    bool prepare(std::vector<DiskRead> &reads);
+    void finish(bool ok);
+};
+
+unsigned BlockRead::length() const
+{
+    return requests.back().begin + requests.back().length - begin();
+}
+
 class TorrentPeer : public Socket
 {
+    friend class BlockRead;
+
 protected:
+    SeederThread &thread;
     TorrentSeeder &server;
     const MetaInfo *info;
+    unsigned m_address;                     // IPv4 address (host order)
 
+    // Received data; bytes [input_begin, input_end) are yet to be processed
     ByteBuffer input;
-    unsigned input_pos;
-    std::queue<ByteBuffer> output;
-    unsigned output_pos;
-
-    enum { handshake, identifier, length, message } waiting_for;
-
-    std::deque<Request> requests;
-    ByteBuffer piece_data;
-    unsigned piece_index;
+    unsigned input_begin, input_end;
+    OutputQueue output;
+
+    enum { handshake, identifier, message } waiting_for;
+
+    std::set<Request> requests;
+    Request next_request;                   // where serving continues
+    std::time_t last_received, last_sent;
+    unsigned pending_reads, pending_bytes;
+    size_t backlog;                         // bytes queued or being read
+    bool draining;                          // backlog above high watermark
+    bool closed;
+
+    bool fast;                              // peer supports the Fast Extension
+    bool choking, peer_interested;
+    std::vector<unsigned> allowed_pieces;   // may be requested while choked
+    RateEstimator upload_rate;              // data sent to the peer
+    TokenBucket upload_bucket;
+
+    // Super-seeding (NULL if not used)
+    SuperSeeder *super_seeder;
+    std::vector<bool> peer_pieces;          // pieces the peer has
+    std::vector<unsigned> offered_pieces;   // pieces announced to the peer
+    int awaited_piece;                      // offered, but not yet passed on
 
     void onReadable();
     void onWritable();
     void onException();
+    void onTimeout();
+    void armTimer();
 
-    void processInput();
-    void processMessage(const ByteBuffer &message);
+    bool processInput();
+    void processMessage(const Byte *message, unsigned size);
 
+    void queueRequest();
+    void updateBacklog();
     void queueOutput(const ByteBuffer &data);
+    bool queueFileData(const Request &r);
     inline void queueMessage(MessageType type);
+    void queueReject(const Request &r);
+    void queueAllowedFast();
+    bool allowedFast(unsigned piece) const;
+    void peerHas(unsigned piece, bool announce);
 
     void destroy();
 
     std::ostream& _info();
 
 public:
-    TorrentPeer(TorrentSeeder &server, int fd);
+    TorrentPeer(SeederThread &thread, int fd, unsigned address);
     ~TorrentPeer();
 
-    inline bool hasRequests() { return !requests.empty(); }
-    unsigned queueRequest();
+    inline unsigned address() const { return m_address; }
+    inline bool isChoking() const { return choking; }
+    inline bool isInterested() const { return peer_interested; }
+    inline RateEstimator &uploadRate() { return upload_rate; }
+    inline const RateEstimator &uploadRate() const { return upload_rate; }
+    inline TokenBucket &uploadBucket() { return upload_bucket; }
+
+    void choke();
+    void unchoke();
+    void resumeWriting();
+    void queueRequests();
+    void superSeed();
+
+    void completeRead(BlockRead &read);
 };
 
 #endif /* ndef TORRENTPEER_H_INCLUDED */
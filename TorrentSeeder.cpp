@@ -1,43 +1,674 @@
 #include "TorrentSeeder.h"
 #include "TorrentPeer.h"
+#include "UtpSocket.h"
 #include "settings.h"
 #include <sys/types.h>
+#include <sys/time.h>
 #ifdef __MINGW32__
 #include <winsock.h>
 typedef int socklen_t;
 #else
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/resource.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #endif
 #include <unistd.h>
+#include <cerrno>
 #include <cstdio>
 #include <algorithm>
+#include <cstdlib>
 #include <fstream>
+#include <iostream>
+
+//
+//  SeederThread
+//
+
+// Receives accepted connections handed off by the listening thread
+class PeerHandoff : public Socket
+{
+    SeederThread &thread;
+
+    void onReadable();
+
+public:
+    PeerHandoff(SeederThread &thread, int fd)
+        : Socket(thread.set(), fd, readable), thread(thread) { };
+};
+
+// A connection passed through the hand-off pipe
+struct Connection
+{
+    int fd;
+    unsigned address;
+};
+
+void PeerHandoff::onReadable()
+{
+    // Note: writes of a single connection are atomic, so the pipe always
+    // contains a whole number of them.
+    Connection connections[64];
+    ssize_t bytes = read(fd, connections, sizeof(connections));
+    if(bytes < 0)
+        perror("read");
+    for(int n = 0; n < int(bytes/sizeof(Connection)); ++n)
+        thread.addPeer(connections[n].fd, connections[n].address);
+}
+
+// Wakes up a seeder thread when disk reads for its peers have completed
+class ReadCompletion : public Socket
+{
+    SeederThread &thread;
+
+    void onReadable();
+
+public:
+    ReadCompletion(SeederThread &thread, int fd)
+        : Socket(thread.set(), fd, readable), thread(thread) { };
+};
+
+void ReadCompletion::onReadable()
+{
+    char buffer[64];
+    if(read(fd, buffer, sizeof(buffer)) < 0)
+        perror("read");
+    thread.processCompletedReads();
+}
+
+static void run_seeder_thread(void *arg)
+{
+    ((SeederThread*)arg)->run();
+}
+
+SeederThread::SeederThread( TorrentSeeder &seeder, SocketSet &set,
+                            unsigned upload_rate, unsigned slots )
+    : m_seeder(seeder), m_set(set), handoff_fd(-1), completion_fd(-1),
+      completion(NULL),
+      completion_pending(0), last_time(std::time(NULL) - 1),
+      bucket(upload_rate), slots(slots), unchoked(0),
+      choke_round(0), next_choke(std::time(NULL) + cfg_choke_interval),
+      rechoke_needed(false), optimistic(NULL)
+{
+    int fds[2];
+    if(pipe(fds) != 0)
+        perror("pipe");
+    else
+    {
+        completion = new ReadCompletion(*this, fds[0]);
+        completion_fd = fds[1];
+    }
+}
+
+// NOTE: only threads that have not been started can be destroyed.
+SeederThread::~SeederThread()
+{
+    delete completion;
+    if(completion_fd >= 0)
+        close(completion_fd);
+    if(handoff_fd >= 0)
+        close(handoff_fd);
+}
+
+bool SeederThread::createHandoff()
+{
+    int fds[2];
+    if(pipe(fds) != 0)
+        return false;
+    new PeerHandoff(*this, fds[0]);
+    handoff_fd = fds[1];
+    return true;
+}
+
+// Hands a newly accepted connection to this thread; may be called from
+// any thread.
+void SeederThread::addConnection(int fd, unsigned address)
+{
+    Connection connection = { fd, address };
+    if(handoff_fd < 0)
+        addPeer(fd, address);
+    else
+    if(write(handoff_fd, &connection, sizeof(connection)) != sizeof(connection))
+    {
+        perror("write");
+        close(fd);
+        m_seeder.releasePeer(address);
+    }
+}
+
+void SeederThread::addPeer(int fd, unsigned address)
+{
+    TorrentPeer *peer = new TorrentPeer(*this, fd, address);
+    peers.push_back(peer);
+
+    if(cfg_upload_rate_per_ip)
+    {
+        std::map<unsigned, AddressLimit>::iterator i =
+            address_limits.find(peer->address());
+        if(i == address_limits.end())
+        {
+            AddressLimit limit = { TokenBucket(cfg_upload_rate_per_ip), 0 };
+            i = address_limits.insert(std::make_pair(peer->address(), limit)).first;
+        }
+        ++i->second.peers;
+    }
+}
+
+void SeederThread::removePeer(TorrentPeer &peer)
+{
+    peers.erase(std::find(peers.begin(), peers.end(), &peer));
+    if(!peer.isChoking())
+    {
+        --unchoked;
+        rechoke_needed = true;
+    }
+    if(optimistic == &peer)
+        optimistic = NULL;
+    throttled.erase(&peer);
+    deferred.erase(&peer);
+
+    std::map<unsigned, AddressLimit>::iterator i =
+        address_limits.find(peer.address());
+    if(i != address_limits.end() && --i->second.peers == 0)
+        address_limits.erase(i);
+}
+
+// Returns the number of bytes that may be written to a peer now. While
+// the thread's limit applies, it is divided among the unchoked peers.
+size_t SeederThread::uploadAllowance(TorrentPeer &peer)
+{
+    size_t allowance = peer.uploadBucket().available();
+
+    if(bucket.limited())
+    {
+        size_t available = bucket.available();
+        size_t share = available/std::max(unchoked, 1u);
+        allowance = std::min(allowance, share > 0 ? share : available);
+    }
+
+    std::map<unsigned, AddressLimit>::iterator i =
+        address_limits.find(peer.address());
+    if(i != address_limits.end())
+        allowance = std::min(allowance, i->second.bucket.available());
+
+    return allowance;
+}
+
+// Charges bytes written to a peer to all limits that apply to it
+void SeederThread::chargeUpload(TorrentPeer &peer, size_t bytes)
+{
+    bucket.consume(bytes);
+    peer.uploadBucket().consume(bytes);
+
+    std::map<unsigned, AddressLimit>::iterator i =
+        address_limits.find(peer.address());
+    if(i != address_limits.end())
+        i->second.bucket.consume(bytes);
+}
+
+// Suspends writing to a peer until processUploads() finds new tokens
+void SeederThread::throttle(TorrentPeer &peer)
+{
+    throttled.insert(&peer);
+}
+
+// Postpones reading data for a peer until processUploads() finds that
+// other peers' output has drained
+void SeederThread::deferRequests(TorrentPeer &peer)
+{
+    deferred.insert(&peer);
+}
+
+// Called when a peer's interest changes. Free upload slots are filled at
+// once, rather than at the next choking round.
+void SeederThread::peerInterested(TorrentPeer &peer, bool interested)
+{
+    if(interested)
+    {
+        if(peer.isChoking() && (slots == 0 || unchoked < slots))
+            unchoke(peer);
+    }
+    else
+    if(!peer.isChoking())
+    {
+        choke(peer);
+        rechoke_needed = true;
+    }
+}
+
+void SeederThread::choke(TorrentPeer &peer)
+{
+    peer.choke();
+    --unchoked;
+}
+
+void SeederThread::unchoke(TorrentPeer &peer)
+{
+    peer.unchoke();
+    ++unchoked;
+}
+
+static bool faster_peer(const TorrentPeer *p, const TorrentPeer *q)
+{
+    return p->uploadRate().rate() > q->uploadRate().rate();
+}
+
+// Number of choking rounds after which the optimistic unchoke moves on
+static const unsigned optimistic_rounds = 3;
+
+// Unchokes the interested peers that download from us the fastest, plus
+// one optimistically unchoked peer that changes every few rounds, so that
+// new peers get a chance to show their rate.
+void SeederThread::rechoke(bool rotate)
+{
+    rechoke_needed = false;
+
+    std::vector<TorrentPeer*> candidates;
+    for( std::deque<TorrentPeer*>::const_iterator i = peers.begin();
+         i != peers.end(); ++i )
+    {
+        if((*i)->isInterested())
+            candidates.push_back(*i);
+    }
+
+    std::set<TorrentPeer*> selected;
+    if(slots == 0)
+        selected.insert(candidates.begin(), candidates.end());
+    else
+    {
+        unsigned regular = slots > 1 ? slots - 1 : 1;
+        std::stable_sort(candidates.begin(), candidates.end(), faster_peer);
+        for(size_t n = 0; n < candidates.size() && n < regular; ++n)
+            selected.insert(candidates[n]);
+
+        if(rotate)
+            ++choke_round;
+        if(slots > 1 && candidates.size() > regular)
+        {
+            if( optimistic == NULL || !optimistic->isInterested() ||
+                selected.count(optimistic) ||
+                (rotate && choke_round%optimistic_rounds == 0) )
+            {
+                optimistic = candidates[ regular +
+                    std::rand()%(candidates.size() - regular) ];
+            }
+            selected.insert(optimistic);
+        }
+        else
+            optimistic = NULL;
+    }
+
+    for( std::deque<TorrentPeer*>::iterator i = peers.begin();
+         i != peers.end(); ++i )
+    {
+        bool upload = selected.count(*i) != 0;
+        if(upload && (*i)->isChoking())
+            unchoke(**i);
+        else
+        if(!upload && !(*i)->isChoking())
+            choke(**i);
+    }
+}
+
+// Hands a finished disk read back to this thread; called from disk threads.
+void SeederThread::completeRead(BlockRead *read)
+{
+    completed_reads.push(read);
+
+    // Only wake up the thread if it has not been notified already
+    if(__sync_lock_test_and_set(&completion_pending, 1) == 0)
+    {
+        char c = 0;
+        if(write(completion_fd, &c, 1) != 1)
+            perror("write");
+    }
+}
+
+void SeederThread::processCompletedReads()
+{
+    __sync_lock_release(&completion_pending);
+
+    BlockRead *read;
+    while(completed_reads.pop(read))
+    {
+        read->peer.completeRead(*read);
+        delete read;
+    }
+}
+
+// Resumes writing to throttled peers and reading for deferred peers, and
+// updates rates and choking once per second. Called after every iteration of the event loop.
+void SeederThread::processUploads()
+{
+    if(!throttled.empty())
+    {
+        // Peers that are still out of tokens will throttle themselves again
+        std::set<TorrentPeer*> resumed;
+        resumed.swap(throttled);
+        for( std::set<TorrentPeer*>::iterator i = resumed.begin();
+             i != resumed.end(); ++i )
+            (*i)->resumeWriting();
+    }
+
+    if(!deferred.empty() && m_seeder.outputAvailable())
+    {
+        std::set<TorrentPeer*> resumed;
+        resumed.swap(deferred);
+        for( std::set<TorrentPeer*>::iterator i = resumed.begin();
+             i != resumed.end(); ++i )
+            (*i)->queueRequests();
+    }
+
+    std::time_t t = std::time(NULL);
+    if(last_time >= t)
+        return;
+    for( std::deque<TorrentPeer*>::iterator i = peers.begin();
+         i != peers.end(); ++i )
+    {
+        (*i)->uploadRate().update(t - last_time);
+        (*i)->superSeed();
+    }
+    last_time = t;
+
+    if(t >= next_choke)
+    {
+        rechoke(true);
+        next_choke = t + cfg_choke_interval;
+    }
+    else
+    if(rechoke_needed)
+        rechoke(false);
+}
+
+// Interval (in milliseconds) at which throttled and deferred peers are
+// resumed
+static const int throttle_interval = 10;
+
+// Returns the time (in milliseconds) the event loop may wait for events
+// before processUploads() must be called again. Other deadlines are kept
+// by the socket set's timers.
+int SeederThread::timeout() const
+{
+    if(!throttled.empty() || !deferred.empty())
+        return throttle_interval;
+
+    // Wake up for the next once-per-second update
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return 1000 - tv.tv_usec/1000;
+}
+
+void SeederThread::run()
+{
+    while(m_set.process(timeout()))
+        processUploads();
+}
+
+
+//
+//  TorrentSeeder
+//
+
+// Number of descriptors kept free for listening sockets, pipes, tracker
+// connections and metadata files, besides 4 per seeder thread for its pipes.
+static const unsigned reserved_descriptors = 64;
+
+// Lowers the limits on open data files and peer connections, if needed, so
+// that they fit within the process's limit on open descriptors (after
+// raising it as far as allowed). Returns the number of descriptors left for
+// peer connections, or 0 if there is no limit.
+static unsigned limitDescriptors()
+{
+#ifndef __MINGW32__
+    struct rlimit limit;
+    if(getrlimit(RLIMIT_NOFILE, &limit) != 0)
+    {
+        perror("getrlimit");
+        return 0;
+    }
+    if(limit.rlim_cur < limit.rlim_max)
+    {
+        rlim_t current = limit.rlim_cur;
+        limit.rlim_cur = limit.rlim_max;
+        if(setrlimit(RLIMIT_NOFILE, &limit) != 0)
+            limit.rlim_cur = current;
+    }
+    if(limit.rlim_cur == RLIM_INFINITY)
+        return 0;
+
+    // Data files get at most half of the remaining descriptors
+    unsigned reserved = reserved_descriptors + 4*std::max(cfg_seeder_threads, 1u);
+    unsigned available = limit.rlim_cur > reserved + 2 ?
+                         (unsigned)(limit.rlim_cur - reserved) : 2;
+    if(cfg_max_open_files > available/2)
+    {
+        std::cerr << "WARNING: limiting open data files to " << available/2
+                  << " (descriptor limit is " << limit.rlim_cur << ")." << std::endl;
+        cfg_max_open_files = available/2;
+    }
+    available -= cfg_max_open_files;
+    if(cfg_seeder_max_peers == 0 || cfg_seeder_max_peers > available)
+    {
+        std::cerr << "WARNING: limiting peer connections to " << available
+                  << " (descriptor limit is " << limit.rlim_cur << ")." << std::endl;
+        cfg_seeder_max_peers = available;
+    }
+    return available;
+#else
+    return 0;
+#endif
+}
 
 TorrentSeeder::TorrentSeeder(SocketSet &set, int fd)
-    : Socket(set, fd, readable)
+    : Socket(set, fd, readable), next_thread(0),
+      piece_cache(cfg_piece_cache_size), disk_io(cfg_disk_threads),
+      pending_output(0), utp(NULL), total_peers(0), peer_descriptors(0),
+      max_descriptors(limitDescriptors())
 {
+
+    // Pending connections are accepted until the backlog is empty
+    setNonBlocking();
+
     sockaddr_in addr;
     socklen_t addr_len = sizeof(addr);
     getsockname(fd, (sockaddr*)&addr, &addr_len);
     m_port = ntohs(addr.sin_port);
+
+    // Divide upload rate and slots evenly among threads; the first one runs
+    // on the main socket set.
+    unsigned count = std::max(cfg_seeder_threads, 1u);
+    unsigned rate  = cfg_upload_rate ? std::max(cfg_upload_rate/count, 1u) : 0;
+    unsigned slots = cfg_upload_slots ? std::max(cfg_upload_slots/count, 1u) : 0;
+    for(unsigned n = 0; n < count; ++n)
+        threads.push_back(new SeederThread( *this,
+            n == 0 ? set : *new SocketSet(), rate, slots ));
+
+    // Accept uTP connections on the same port
+    if(cfg_utp && !(utp = UtpSocket::create(*this, set, m_port)))
+        std::cerr << "WARNING: unable to create uTP socket; "
+                     "only accepting TCP connections." << std::endl;
 }
 
 TorrentSeeder::~TorrentSeeder()
 {
+    delete utp;
     for(MetaInfoMap::iterator i = metainfo.begin(); i != metainfo.end(); ++i)
         i->second->release();
+    for( std::map<std::string, SuperSeeder*>::iterator i = super_seeders.begin();
+         i != super_seeders.end(); ++i )
+        i->second->release();
 }
 
+// Maximum number of connections accepted per call to onReadable()
+static const int max_accepts = 64;
+
+// Time (in milliseconds) for which accepting stops when out of descriptors
+static const unsigned long accept_backoff = 250;
+
+// Accepts pending connections. Connections exceeding the limits are closed
+// right away, before any state is allocated for them.
 void TorrentSeeder::onReadable()
 {
-    int newfd = accept(fd, NULL, NULL);
-    if(newfd < 0)
-        perror("accept failed");
+    for(int n = 0; n < max_accepts; ++n)
+    {
+        sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+#ifdef HAVE_ACCEPT4
+        int newfd = accept4(fd, (sockaddr*)&addr, &addr_len, SOCK_NONBLOCK);
+#else
+        int newfd = accept(fd, (sockaddr*)&addr, &addr_len);
+#endif
+        if(newfd < 0)
+        {
+            if(errno == EMFILE || errno == ENFILE)
+            {
+                // The connection stays in the backlog, so the socket stays
+                // readable; stop polling it for a while instead.
+                perror("accept failed");
+                setMask(0);
+                setTimer(accept_backoff);
+            }
+            else
+            if( errno != EAGAIN && errno != EWOULDBLOCK &&
+                errno != EINTR && errno != ECONNABORTED )
+                perror("accept failed");
+            break;
+        }
+
+        unsigned ip = ntohl(addr.sin_addr.s_addr);
+        if(!admitPeer(ip))
+        {
+            close(newfd);
+            continue;
+        }
+        dispatchConnection(newfd, ip);
+    }
+}
+
+// Resumes accepting connections after running out of descriptors
+void TorrentSeeder::onTimeout()
+{
+    setMask(readable);
+}
+
+// Passes an admitted connection (TCP, or the local end of a uTP connection)
+// to a seeder thread. Must be called on the main thread.
+void TorrentSeeder::dispatchConnection(int fd, unsigned address)
+{
+    if(cfg_upload_rate_per_ip)
+    {
+        // Serve all connections from an address on the same thread, so
+        // that its rate limit is enforced in one place.
+        threads[(address*2654435761u >> 8)%threads.size()]->addConnection(fd, address);
+    }
     else
-        peers.push_back(new TorrentPeer(*this, newfd));
+    {
+        // Distribute connections round-robin over seeder threads
+        threads[next_thread]->addConnection(fd, address);
+        next_thread = (next_thread + 1)%threads.size();
+    }
+}
+
+// Returns whether the bytes queued for all peers are below the limit
+bool TorrentSeeder::outputAvailable() const
+{
+    return cfg_max_pending_output == 0 ||
+           pending_output < (long)cfg_max_pending_output;
+}
+
+// Registers a new connection from the given address, which uses the given
+// number of descriptors. Returns false if this would exceed the limit on
+// the number of peers in total or per address, or on the descriptors
+// available for peers.
+bool TorrentSeeder::admitPeer(unsigned address, unsigned descriptors)
+{
+    omni_mutex_lock l(admission_mutex);
+    if(cfg_seeder_max_peers && total_peers >= cfg_seeder_max_peers)
+        return false;
+    if(max_descriptors && peer_descriptors + descriptors > max_descriptors)
+        return false;
+    unsigned &count = address_peers[address];
+    if(cfg_seeder_max_peers_per_ip && count >= cfg_seeder_max_peers_per_ip)
+        return false;
+    ++count;
+    ++total_peers;
+    peer_descriptors += descriptors;
+    return true;
+}
+
+// Unregisters a connection, and the descriptor of its socket
+void TorrentSeeder::releasePeer(unsigned address)
+{
+    omni_mutex_lock l(admission_mutex);
+    std::map<unsigned, unsigned>::iterator i = address_peers.find(address);
+    if(i != address_peers.end() && --i->second == 0)
+        address_peers.erase(i);
+    --total_peers;
+    --peer_descriptors;
+}
+
+// Releases an additional descriptor reserved by admitPeer()
+void TorrentSeeder::releaseDescriptor()
+{
+    omni_mutex_lock l(admission_mutex);
+    --peer_descriptors;
+}
+
+// Registers a peer for a torrent after its handshake. Returns false if the
+// torrent already has the maximum number of peers.
+bool TorrentSeeder::admitTorrentPeer(const std::string &infohash)
+{
+    omni_mutex_lock l(admission_mutex);
+    unsigned &count = torrent_peers[infohash];
+    if(cfg_seeder_max_peers_per_torrent && count >= cfg_seeder_max_peers_per_torrent)
+        return false;
+    ++count;
+    return true;
+}
+
+void TorrentSeeder::releaseTorrentPeer(const std::string &infohash)
+{
+    omni_mutex_lock l(admission_mutex);
+    std::map<std::string, unsigned>::iterator i = torrent_peers.find(infohash);
+    if(i != torrent_peers.end() && --i->second == 0)
+        torrent_peers.erase(i);
+}
+
+// Starts disk threads and additional seeder threads (if any)
+void TorrentSeeder::start()
+{
+    if(cfg_io_uring_entries > 0 && !disk_io.enableUring(cfg_io_uring_entries))
+        std::cerr << "WARNING: io_uring not supported; "
+                     "using disk threads instead." << std::endl;
+    disk_io.start();
+
+    for(size_t n = 1; n < threads.size(); ++n)
+    {
+        if(threads[n]->createHandoff())
+            omni_thread::create(run_seeder_thread, threads[n]);
+        else
+        {
+            perror("create seeder thread");
+            for(size_t m = n; m < threads.size(); ++m)
+            {
+                SocketSet &set = threads[m]->set();
+                delete threads[m];
+                delete &set;
+            }
+            threads.erase(threads.begin() + n, threads.end());
+        }
+    }
+}
+
+void TorrentSeeder::processUploads()
+{
+    threads[0]->processUploads();
+}
+
+int TorrentSeeder::timeout() const
+{
+    return threads[0]->timeout();
 }
 
 TorrentSeeder* TorrentSeeder::create(SocketSet &set)
@@ -63,7 +694,7 @@ TorrentSeeder* TorrentSeeder::create(SocketSet &set)
         return NULL;
     }
 
-    if(listen(fd, 8) < 0)
+    if(listen(fd, cfg_listen_backlog) < 0)
     {
         close(fd);
         return NULL;
@@ -80,14 +711,28 @@ const std::string &TorrentSeeder::id()
 
 const MetaInfo *TorrentSeeder::getMetaInfo(const std::string &infohash) const
 {
+    omni_mutex_lock l(metainfo_mutex);
+    MetaInfoMap::const_iterator i = metainfo.find(infohash);
+    if(i == metainfo.end())
+        return NULL;
+    return i->second;
+}
+
+// Like getMetaInfo(), but acquires a reference to the result, so it can
+// be used safely from seeder threads while torrents are being removed.
+const MetaInfo *TorrentSeeder::acquireMetaInfo(const std::string &infohash) const
+{
+    omni_mutex_lock l(metainfo_mutex);
     MetaInfoMap::const_iterator i = metainfo.find(infohash);
     if(i == metainfo.end())
         return NULL;
+    i->second->acquire();
     return i->second;
 }
 
 bool TorrentSeeder::hasMetaInfo(const std::string &infohash) const
 {
+    omni_mutex_lock l(metainfo_mutex);
     return metainfo.find(infohash) != metainfo.end();
 }
 
@@ -102,41 +747,54 @@ unsigned TorrentSeeder::ip() const
     return ((struct in_addr *)he->h_addr_list[0])->s_addr;
 }
 
-void TorrentSeeder::removePeer(TorrentPeer &peer)
-{
-    peers.erase(std::find(peers.begin(), peers.end(), &peer));
-}
-
-unsigned TorrentSeeder::queueUploadData(unsigned target)
+// Returns the super-seeding state of a torrent (acquired), or NULL if the
+// torrent is not super-seeded.
+SuperSeeder *TorrentSeeder::acquireSuperSeeder(const std::string &infohash) const
 {
-    unsigned queued = 0;
-    int n = peers.size();
-    while(n-- && queued < target)
-    {
-        TorrentPeer *peer = peers.front();
-        peers.pop_front();
-        while(peer->hasRequests() && queued < target)
-            queued += peer->queueRequest();
-        peers.push_back(peer);
-    }
-    return queued;
+    omni_mutex_lock l(metainfo_mutex);
+    std::map<std::string, SuperSeeder*>::const_iterator i =
+        super_seeders.find(infohash);
+    if(i == super_seeders.end())
+        return NULL;
+    i->second->acquire();
+    return i->second;
 }
 
 // NOTE: takes ownership of info!
 void TorrentSeeder::addTorrent(MetaInfo *info)
 {
+    omni_mutex_lock l(metainfo_mutex);
     MetaInfo * &ptr = metainfo[info->infohash()];
     if(ptr != NULL)
         ptr->release();
     ptr = info;
+
+    std::map<std::string, SuperSeeder*>::iterator i =
+        super_seeders.find(info->infohash());
+    if(i != super_seeders.end())
+    {
+        i->second->release();
+        super_seeders.erase(i);
+    }
+    if(info->superSeeding())
+        super_seeders[info->infohash()] = new SuperSeeder(info->pieces());
 }
 
 void TorrentSeeder::removeTorrent(MetaInfo *info)
 {
+    omni_mutex_lock l(metainfo_mutex);
     MetaInfoMap::iterator i = metainfo.find(info->infohash());
     if(i != metainfo.end())
     {
         i->second->release();
         metainfo.erase(i);
     }
+
+    std::map<std::string, SuperSeeder*>::iterator j =
+        super_seeders.find(info->infohash());
+    if(j != super_seeders.end())
+    {
+        j->second->release();
+        super_seeders.erase(j);
+    }
 }
@@ -3,42 +3,163 @@
 
 #include <string>
 #include <map>
+#include <set>
 #include <deque>
+#include <vector>
+#include <ctime>
+#include <omnithread.h>
 
+#include "DiskIO.h"
 #include "MetaInfo.h"
+#include "PieceCache.h"
+#include "Queue.h"
 #include "Socket.h"
+#include "SuperSeeder.h"
+#include "TokenBucket.h"
+
+#ifdef __linux__
+#define HAVE_ACCEPT4
+#endif
 
 class TorrentPeer;
 class TorrentEvent;
+class BlockRead;
+class TorrentSeeder;
+class UtpSocket;
+class ReadCompletion;
 
 typedef std::map<std::string, MetaInfo*> MetaInfoMap;
 
+// A group of peer connections served by a single event loop. The first
+// thread shares the main socket set; others run their own loop.
+class SeederThread
+{
+    TorrentSeeder &m_seeder;
+    SocketSet &m_set;
+    std::deque<TorrentPeer*> peers;
+    int handoff_fd;     // write end of hand-off pipe (or -1 if not used)
+    int completion_fd;  // write end of disk read completion pipe
+    ReadCompletion *completion;
+    Queue<BlockRead*> completed_reads;
+    volatile int completion_pending;
+    std::time_t last_time;
+
+    // Upload rate limits; peers with the same address are always served by
+    // the same thread, so their limit need not be shared between threads.
+    struct AddressLimit
+    {
+        TokenBucket bucket;
+        unsigned peers;
+    };
+    TokenBucket bucket;
+    std::map<unsigned, AddressLimit> address_limits;
+    std::set<TorrentPeer*> throttled;
+    std::set<TorrentPeer*> deferred;    // waiting for output to drain
+
+    // Choking
+    unsigned slots, unchoked, choke_round;
+    std::time_t next_choke;
+    bool rechoke_needed;
+    TorrentPeer *optimistic;
+
+    void choke(TorrentPeer &peer);
+    void unchoke(TorrentPeer &peer);
+    void rechoke(bool rotate);
+
+public:
+    SeederThread( TorrentSeeder &seeder, SocketSet &set,
+                  unsigned upload_rate, unsigned slots );
+    ~SeederThread();
+
+    inline TorrentSeeder &seeder() { return m_seeder; }
+    inline SocketSet &set() { return m_set; }
+
+    bool createHandoff();
+    void addConnection(int fd, unsigned address);
+    void addPeer(int fd, unsigned address);
+    void removePeer(TorrentPeer &peer);
+    void peerInterested(TorrentPeer &peer, bool interested);
+
+    size_t uploadAllowance(TorrentPeer &peer);
+    void chargeUpload(TorrentPeer &peer, size_t bytes);
+    void throttle(TorrentPeer &peer);
+    void deferRequests(TorrentPeer &peer);
+
+    void completeRead(BlockRead *read);
+    void processCompletedReads();
+
+    void processUploads();
+    int timeout() const;
+    void run();
+};
+
 class TorrentSeeder : public Socket
 {
 protected:
     unsigned short m_port;
     MetaInfoMap metainfo;
-    std::deque<TorrentPeer*> peers;
+    std::map<std::string, SuperSeeder*> super_seeders;
+    mutable omni_mutex metainfo_mutex;
+    std::vector<SeederThread*> threads;
+    unsigned next_thread;
+    PieceCache piece_cache;
+    DiskIO disk_io;
+    volatile long pending_output;       // bytes queued for all peers
+    UtpSocket *utp;                     // NULL if uTP is not used
+
+    // Number of connected peers, in total and per address and torrent
+    omni_mutex admission_mutex;
+    unsigned total_peers;
+    unsigned peer_descriptors, max_descriptors;  // max is 0 if unlimited
+    std::map<unsigned, unsigned> address_peers;
+    std::map<std::string, unsigned> torrent_peers;
 
     TorrentSeeder(SocketSet &set, int fd);
     void onReadable();
+    void onTimeout();
 
 public:
     static TorrentSeeder *create(SocketSet &set);
     ~TorrentSeeder();
 
+    void start();
+    void processUploads();
+    int timeout() const;
+
     unsigned ip() const;
     inline unsigned short port() const { return m_port; }
     const std::string &id();
+    inline PieceCache &pieceCache() { return piece_cache; }
+    inline DiskIO &diskIO() { return disk_io; }
+
+    inline void reserveOutput(size_t bytes);
+    inline void releaseOutput(size_t bytes);
+    bool outputAvailable() const;
 
     const MetaInfo *getMetaInfo(const std::string &infohash) const;
+    const MetaInfo *acquireMetaInfo(const std::string &infohash) const;
     bool hasMetaInfo(const std::string &infohash) const;
+    SuperSeeder *acquireSuperSeeder(const std::string &infohash) const;
 
-    unsigned queueUploadData(unsigned target);
-    void removePeer(TorrentPeer &peer);
+    bool admitPeer(unsigned address, unsigned descriptors = 1);
+    void releasePeer(unsigned address);
+    void releaseDescriptor();
+    bool admitTorrentPeer(const std::string &infohash);
+    void releaseTorrentPeer(const std::string &infohash);
+    void dispatchConnection(int fd, unsigned address);
 
     void addTorrent(MetaInfo *info);
     void removeTorrent(MetaInfo *info);
 };
 
+void TorrentSeeder::reserveOutput(size_t bytes)
+{
+    __sync_add_and_fetch(&pending_output, (long)bytes);
+}
+
+void TorrentSeeder::releaseOutput(size_t bytes)
+{
+    __sync_sub_and_fetch(&pending_output, (long)bytes);
+}
+
 #endif /* ndef TORRENTSERVER_H_INCLUDED */
@@ -12,6 +12,8 @@ typedef int socklen_t;
 #include <arpa/inet.h>
 #endif
 #include <unistd.h>
+#include <cerrno>
+#include <cstdio>
 #include <algorithm>
 #include <iostream>
 #include <sstream>
@@ -27,6 +29,8 @@ class TrackerRequestHandler : public HttpRequestHandler
     void handleRequest(std::ostream &os, HttpRequest &request);
     void handleAnnounceRequest(std::ostream &os, HttpRequest &request);
     void handleScrapeRequest(std::ostream &os, HttpRequest &request);
+    void handleStatsRequest(std::ostream &os, HttpRequest &request);
+    void handleDataRequest(std::ostream &os, HttpRequest &request);
 
 public:
     TrackerRequestHandler (TorrentTracker &tracker, int fd, unsigned ip);
@@ -80,7 +84,13 @@ void TrackerRequestHandler::handleRequest(std::ostream &os, HttpRequest &request
     if(request.location == "/scrape")
         handleScrapeRequest(os, request);
     else
-        os << "HTTP/1.0 404 Not Found\r\n\r\nResource not found.\r\n";
+    if(request.location == "/stats")
+        handleStatsRequest(os, request);
+    else
+    if(cfg_web_seed && request.location.compare(0, 6, "/data/") == 0)
+        handleDataRequest(os, request);
+    else
+        writeReply(os, "404 Not Found", "Resource not found.\r\n");
 }
 
 void TrackerRequestHandler::handleAnnounceRequest(std::ostream &os, HttpRequest &request)
@@ -93,7 +103,7 @@ void TrackerRequestHandler::handleAnnounceRequest(std::ostream &os, HttpRequest
         ( (i = vars.find("numwant")) != vars.end() &&
           (!parseInt(i->second, numWant) || numWant < 0) ) )
     {
-        os << "HTTP/1.0 400 Bad Request\r\n\r\nBad Request\r\n";
+        writeReply(os, "400 Bad Request", "Bad Request\r\n");
         return;
     }
 
@@ -105,7 +115,7 @@ void TrackerRequestHandler::handleAnnounceRequest(std::ostream &os, HttpRequest
     if( tracker.torrent_peers.find(vars.find("info_hash")->second)
         == tracker.torrent_peers.end() )
     {
-        os << "HTTP/1.0 403 Forbidden\r\n\r\nForbidden\r\n";
+        writeReply(os, "403 Forbidden", "Forbidden\r\n");
         return;
     }
 
@@ -130,99 +140,184 @@ void TrackerRequestHandler::handleAnnounceRequest(std::ostream &os, HttpRequest
         peer.left = 0;
 
     // Store peer state
-    tracker.store(peer, port == 0 || event == "stopped");
+    tracker.store(peer, port == 0 || event == "stopped", event == "completed");
 
-    // Get list of peers to display
-    std::vector<const PeerInfo*> peers = tracker.list(peer.peer_id, peer.info_hash, numWant);
+    if((i = vars.find("compact")) != vars.end() && i->second == "1")
+    {
+        // Compact listing, copied from the peer table into the reply. No
+        // more peers can be listed than the tracker keeps (plus itself).
+        numWant = std::min(numWant, tracker.max_peers_per_torrent + 1ll);
+        std::string peers(6*numWant, '\0');
+        if(numWant > 0)
+            peers.resize(tracker.listCompact(peer.peer_id, peer.info_hash, numWant, &peers[0]));
+
+        std::ostringstream prefix;
+        prefix << "d8:intervali" << tracker.update_interval << "e"
+               << "5:peers" << peers.size() << ':';
+        writeHeader(os, "200 OK", prefix.str().size() + peers.size() + 1);
+        os << "Content-Type: text/plain\r\n\r\n" << prefix.str() << peers << 'e';
+        return;
+    }
 
+    // Full listing
+    std::vector<const PeerInfo*> peers = tracker.list(peer.peer_id, peer.info_hash, numWant);
     Value reply;
     Dict &replyDict = reply.makeDict();
     replyDict["interval"].assign(tracker.update_interval);
-    if((i = vars.find("compact")) != vars.end() && i->second == "1")
-    {
-        // Compact listing
-        std::string &peersString = replyDict["peers"].makeString();
-        peersString.reserve(6*peers.size());
-        for(size_t n = 0; n < peers.size(); ++n)
-        {
-            char data[6] = {
-                ((char*)&(peers[n]->ip))[0],
-                ((char*)&(peers[n]->ip))[1],
-                ((char*)&(peers[n]->ip))[2],
-                ((char*)&(peers[n]->ip))[3],
-                ((peers[n]->port)>>8)&255,
-                (peers[n]->port)&255 };
-            peersString.append(data, 6);
-        }
-    }
-    else
+    List &peersList = replyDict["peers"].makeList();
+    peersList.resize(peers.size());
+    for(size_t n = 0; n < peers.size(); ++n)
     {
-        // Full listing
-        List &peersList = replyDict["peers"].makeList();
-        peersList.resize(peers.size());
-        for(size_t n = 0; n < peers.size(); ++n)
-        {
-            Dict &peerDict = peersList[n].makeDict();
-            peerDict["peer id"].assign(peers[n]->peer_id, 20);
-            peerDict["ip"].assign(ipToString(peers[n]->ip));
-            peerDict["port"].assign(peers[n]->port);
-        }
+        Dict &peerDict = peersList[n].makeDict();
+        peerDict["peer id"].assign(peers[n]->peer_id, 20);
+        peerDict["ip"].assign(ipToString(peers[n]->ip));
+        peerDict["port"].assign(peers[n]->port);
     }
 
-    os << "HTTP/1.0 200 OK\r\nContent-type: text/plain\r\n\r\n";
-    bencode(os, reply); 
+    writeReply(os, "200 OK", bencode(reply));
 }
 
 void TrackerRequestHandler::handleScrapeRequest(std::ostream &os, HttpRequest &request)
 {
+    QueryVarMap vars = parseQueryString(request.query);
+    std::pair<QueryVarMap::const_iterator, QueryVarMap::const_iterator>
+        hashes = vars.equal_range("info_hash");
+    if(hashes.first == hashes.second)
+    {
+        writeReply(os, "200 OK", tracker.fullScrape());
+        return;
+    }
+
     Value reply;
     Dict &filesDict = reply.makeDict()["files"].makeDict();
+    for(QueryVarMap::const_iterator i = hashes.first; i != hashes.second; ++i)
+        tracker.addScrapeEntry(filesDict, i->second);
+    writeReply(os, "200 OK", bencode(reply));
+}
 
-    QueryVarMap vars = parseQueryString(request.query);
-    QueryVarMap::const_iterator i = vars.find("info_hash");
+void TrackerRequestHandler::handleStatsRequest(std::ostream &os, HttpRequest &request)
+{
+    DiskIO &disk_io = tracker.seeder.diskIO();
+    std::ostringstream stats;
+    stats << "disk_queue_depth " << disk_io.depth() << "\n"
+          << "disk_reads_completed " << disk_io.completed() << "\n"
+          << "disk_read_latency_avg_us " << disk_io.averageLatency() << "\n"
+          << "disk_read_latency_max_us " << disk_io.maximumLatency() << "\n";
+    writeReply(os, "200 OK", stats.str());
+}
 
-    for( TorrentTracker::TorrentPeerInfoMap::const_iterator j =
-            tracker.torrent_peers.begin(); j != tracker.torrent_peers.end(); ++j )
-    {
-        if(i != vars.end() && i->second != j->first)
-            continue;
+// Parses the value of a Range header for a resource of the given length.
+// Only a single byte range is supported; returns false if the header should
+// be ignored, or sets first > last if the range is unsatisfiable.
+bool parseRange( const std::string &value, long long length,
+                 long long &first, long long &last )
+{
+    if(value.compare(0, 6, "bytes=") != 0 || value.find(',') != std::string::npos)
+        return false;
 
-        long long complete = 0, incomplete = 0;
-        for( TorrentTracker::PeerInfoList::const_iterator k =
-                j->second.begin(); k != j->second.end(); ++k )
-        {
-            if(k->left == 0)
-                ++complete;
-            if(k->left > 0)
-                ++incomplete;
-        }
+    std::string::size_type sep = value.find('-', 6);
+    if(sep == std::string::npos)
+        return false;
+    std::string begin(value, 6, sep - 6), end(value, sep + 1);
+    if(begin.empty())
+    {
+        // Suffix range: the last bytes of the resource
+        long long suffix;
+        if(!parseInt(end, suffix) || suffix < 0)
+            return false;
+        first = std::max(length - suffix, 0ll);
+        last  = length - 1;
+        if(suffix == 0)
+            first = length;
+        return true;
+    }
+    if( !parseInt(begin, first) || first < 0 ||
+        (!end.empty() && (!parseInt(end, last) || last < first)) )
+        return false;
+    if(end.empty() || last >= length)
+        last = length - 1;
+    return true;
+}
 
-        Dict &dict = filesDict[j->first].makeDict();
-        dict["complete"].assign(complete);
-        dict["incomplete"].assign(incomplete);
-        dict["downloaded"].assign(0ll);   // TODO
-        const MetaInfo *info = tracker.seeder.getMetaInfo(j->first);
+// Serves a data file, so the tracker can be used as a web seed (BEP 19).
+// The location is /data/ followed by the name of a torrent and (for a
+// multi-file torrent) the path of a file in it.
+void TrackerRequestHandler::handleDataRequest(std::ostream &os, HttpRequest &request)
+{
+    // Find torrent and file
+    std::string path = urldecode( request.location.data() + 6,
+                                  request.location.data() + request.location.size() );
+    std::string::size_type sep = path.find('/');
+    TorrentTracker::TorrentNameMap::const_iterator i =
+        tracker.torrent_names.find(path.substr(0, sep));
+    const MetaInfo *info = NULL;
+    unsigned file;
+    long long length;
+    if(i != tracker.torrent_names.end())
+        info = tracker.seeder.acquireMetaInfo(i->second);
+    if( info == NULL || !info->findFile( sep == std::string::npos ?
+            std::string() : path.substr(sep), file, length ) )
+    {
         if(info)
-            dict["name"].assign(info->name());
+            info->release();
+        writeReply(os, "404 Not Found", "Resource not found.\r\n");
+        return;
+    }
+
+#ifndef HAVE_SENDFILE
+    info->release();
+    writeReply(os, "501 Not Implemented", "Not Implemented\r\n");
+    return;
+#endif
+
+    long long first = 0, last = length - 1;
+    std::string range;
+    bool partial = request.header("Range", range) &&
+                   parseRange(range, length, first, last);
+    if(partial && first > last)
+    {
+        info->release();
+        writeHeader(os, "416 Requested Range Not Satisfiable", 0);
+        os << "Content-Range: bytes */" << length << "\r\n\r\n";
+        return;
     }
 
-    os << "HTTP/1.0 200 OK\r\nContent-type: text/plain\r\n\r\n";
-    bencode(os, reply); 
+    writeHeader(os, partial ? "206 Partial Content" : "200 OK", last - first + 1);
+    os << "Content-Type: application/octet-stream\r\n"
+       << "Accept-Ranges: bytes\r\n";
+    if(partial)
+        os << "Content-Range: bytes " << first << '-' << last << '/' << length << "\r\n";
+    os << "\r\n";
+
+    if(request.method != "HEAD" && last >= first)
+        sendFile(info, file, first, last - first + 1);
+    info->release();
 }
 
 TorrentTracker::TorrentTracker(int fd, TorrentSeeder &seeder, unsigned port)
     : Socket(seeder.set(), fd, readable), port(port), seeder(seeder),
       update_interval(cfg_tracker_rerequest_interval),
       purge_interval(cfg_tracker_purge_interval),
-      max_peers_per_torrent(cfg_tracker_max_peers_per_torrent)
+      max_peers_per_torrent(cfg_tracker_max_peers_per_torrent),
+      scrape_interval(cfg_tracker_scrape_interval), udp(NULL),
+      full_scrape_time(0)
 {
     std::memcpy(local_peer.peer_id, seeder.id().data(), 20);
     local_peer.ip   = seeder.ip();
     local_peer.port = seeder.port();
+    std::memcpy(local_record, &local_peer.ip, 4);
+    local_record[4] = local_peer.port >> 8;
+    local_record[5] = local_peer.port;
+
+    // Accept UDP tracker requests on the same port
+    if(cfg_udp_tracker && !(udp = UdpTracker::create(*this, port)))
+        std::cerr << "WARNING: unable to create UDP tracker socket; "
+                     "only accepting HTTP requests." << std::endl;
 }
 
 TorrentTracker::~TorrentTracker()
 {
+    delete udp;
 }
 
 
@@ -233,6 +328,21 @@ void TorrentTracker::onReadable()
     int newfd = accept(fd, (struct sockaddr*)&addr, &len);
     if(newfd >= 0 && len == sizeof(addr))
         new TrackerRequestHandler(*this, newfd, addr.sin_addr.s_addr);
+    else
+    if(newfd < 0 && (errno == EMFILE || errno == ENFILE))
+    {
+        // Out of descriptors; stop polling the socket for a while, since
+        // the connection stays in the backlog.
+        perror("accept failed");
+        setMask(0);
+        setTimer(250);
+    }
+}
+
+// Resumes accepting connections after running out of descriptors
+void TorrentTracker::onTimeout()
+{
+    setMask(readable);
 }
 
 TorrentTracker* TorrentTracker::create(TorrentSeeder &seeder, unsigned short port)
@@ -247,7 +357,7 @@ TorrentTracker* TorrentTracker::create(TorrentSeeder &seeder, unsigned short por
     addr.sin_addr.s_addr = 0;
     addr.sin_port = htons(port);
     if( bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
-        listen(fd, 8) < 0 )
+        listen(fd, cfg_listen_backlog) < 0 )
     {
         close(fd);
         return NULL;
@@ -256,63 +366,129 @@ TorrentTracker* TorrentTracker::create(TorrentSeeder &seeder, unsigned short por
     return new TorrentTracker(fd, seeder, port);
 }
 
-bool TorrentTracker::store(const PeerInfo &peer, bool stopped)
+bool TorrentTracker::store(const PeerInfo &peer, bool stopped, bool completed)
 {
-    std::deque<PeerInfo> &peers = torrent_peers[std::string(peer.info_hash, 20)];
+    PeerTable &peers = torrent_peers[std::string(peer.info_hash, 20)];
+    const PeerInfo *old = peers.find(peer.peer_id);
+
+    // Count a download as completed when the peer reports it, or when it
+    // stops being a leecher (but only once).
+    if(completed || (old && old->left > 0 && peer.left == 0))
+        peers.addCompleted();
 
-    // Remove existing entry (based on peer id)
-    for( std::deque<PeerInfo>::iterator i = peers.begin();
-         i != peers.end(); ++i )
+    if(stopped)
     {
-        if(memcmp(peer.peer_id, i->peer_id, 20) == 0)
-        {
-            peers.erase(i);
-            break;
-        }
+        peers.remove(peer.peer_id);
+        return true;
     }
 
-    if(!stopped)
+    // Evict the peers that announced least recently to make room
+    if(old == NULL)
     {
-        while(int(peers.size()) >= max_peers_per_torrent)
-            peers.erase(peers.begin());
-        peers.push_back(peer);
-        peers.back().last_time = std::time(NULL);
+        while(peers.size() > 0 && int(peers.size()) >= max_peers_per_torrent)
+            peers.removeOldest();
     }
+
+    PeerInfo updated = peer;
+    updated.last_time = std::time(NULL);
+    peers.update(updated);
     return true;
 }
 
+// Returns the peers of a torrent, after purging those that haven't
+// announced recently.
+PeerTable &TorrentTracker::currentPeers(const char *info_hash)
+{
+    PeerTable &peers = torrent_peers[std::string(info_hash, 20)];
+    peers.purge(std::time(NULL) - purge_interval);
+    return peers;
+}
+
+// Returns up to count peers of a torrent, chosen at random from the peers
+// other than the one with the given id. The local peer is always included.
 std::vector<const PeerInfo*> TorrentTracker::list(
     const char *omit_id, const char *info_hash, int count )
 {
-    std::deque<PeerInfo> &peers = torrent_peers[std::string(info_hash, 20)];
-
-    // Purge peers
-    int purge_time = std::time(NULL) - purge_interval;
-    std::deque<PeerInfo>::iterator i = peers.begin();
-    while(i != peers.end() && peers.front().last_time <= purge_time)
-        ++i;
-    peers.erase(peers.begin(), i);
-
-    // Build list of results
     std::vector<const PeerInfo*> result;
-    for( std::deque<PeerInfo>::const_iterator i = peers.begin();
-         i != peers.end(); ++i )
-    {
-        if( memcmp(info_hash, i->info_hash, 20) == 0 &&
-            ( omit_id == NULL || memcmp(omit_id, i->peer_id, 20)) )
-            result.push_back(&(*i));
-    }
+    if(count <= 0)
+        return result;
 
-    // Always add local peer
+    PeerTable &peers = currentPeers(info_hash);
+    size_t sampled = peers.sample(count - 1, omit_id);
+    result.reserve(sampled + 1);
     result.push_back(&local_peer);
-
-    // Send a random (and shuffled) subset of size upto 'count'
-    std::random_shuffle(result.begin(), result.end());
-    if(int(result.size()) > count)
-        result.erase(result.begin() + count, result.end());
+    for(size_t n = 0; n < sampled; ++n)
+        result.push_back(&peers[n]);
     return result;
 }
 
+// Like list(), but writes the compact peer info (6 bytes per peer) to out,
+// which must have room for count peers. Returns the number of bytes written.
+size_t TorrentTracker::listCompact( const char *omit_id, const char *info_hash,
+                                    int count, char *out )
+{
+    if(count <= 0)
+        return 0;
+
+    PeerTable &peers = currentPeers(info_hash);
+    size_t sampled = peers.sample(count - 1, omit_id);
+    memcpy(out, local_record, 6);
+    memcpy(out + 6, peers.compact(), 6*sampled);
+    return 6*(sampled + 1);
+}
+
+// Returns the number of peers of a torrent that have completed the download,
+// of those that haven't, and of downloads completed. Returns false if the
+// torrent is not tracked.
+bool TorrentTracker::countPeers( const std::string &info_hash, long long &complete,
+                                 long long &incomplete, long long &downloaded )
+{
+    complete = incomplete = downloaded = 0;
+    if(torrent_peers.find(info_hash) == torrent_peers.end())
+        return false;
+
+    const PeerTable &peers = currentPeers(info_hash.data());
+    complete   = peers.seeders();
+    incomplete = peers.leechers();
+    downloaded = peers.completed();
+    return true;
+}
+
+// Adds the scrape information of a torrent to the files dictionary of a
+// scrape reply, if it is tracked.
+void TorrentTracker::addScrapeEntry(Dict &files, const std::string &info_hash)
+{
+    long long complete, incomplete, downloaded;
+    if(!countPeers(info_hash, complete, incomplete, downloaded))
+        return;
+
+    Dict &dict = files[info_hash].makeDict();
+    dict["complete"].assign(complete);
+    dict["incomplete"].assign(incomplete);
+    dict["downloaded"].assign(downloaded);
+    const MetaInfo *info = seeder.getMetaInfo(info_hash);
+    if(info)
+        dict["name"].assign(info->name());
+}
+
+// Returns the reply to a scrape of all torrents. It is rebuilt when it is
+// older than the scrape interval, or when torrents have been added or removed.
+const std::string &TorrentTracker::fullScrape()
+{
+    std::time_t now = std::time(NULL);
+    if(full_scrape.empty() || now - full_scrape_time >= scrape_interval)
+    {
+        Value reply;
+        Dict &filesDict = reply.makeDict()["files"].makeDict();
+        for( TorrentPeerInfoMap::const_iterator i = torrent_peers.begin();
+             i != torrent_peers.end(); ++i )
+            addScrapeEntry(filesDict, i->first);
+        full_scrape = bencode(reply);
+        full_scrape_time = now;
+    }
+    return full_scrape;
+}
+
 struct TorrentEvent
 {
     enum { Added, Removed } type;
@@ -342,11 +518,15 @@ void TorrentTracker::processQueuedEvents()
         {
         case TorrentEvent::Added:
             torrent_peers[event.info->infohash()];
+            torrent_names[event.info->name()] = event.info->infohash();
+            full_scrape.clear();
             seeder.addTorrent(event.info);
             break;
 
         case TorrentEvent::Removed:
             torrent_peers.erase(event.info->infohash());
+            torrent_names.erase(event.info->name());
+            full_scrape.clear();
             seeder.removeTorrent(event.info);
             break;
         }
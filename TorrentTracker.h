@@ -1,42 +1,50 @@
 #ifndef TORRENTTRACKER_H_INCLUDED
 #define TORRENTTRACKER_H_INCLUDED
 
+#include "PeerTable.h"
 #include "Socket.h"
 #include "TorrentSeeder.h"
 #include "Queue.h"
+#include "UdpTracker.h"
 
 #include <vector>
 #include <ctime>
 
-struct PeerInfo
-{
-    char info_hash[20], peer_id[20];
-    unsigned ip;
-    unsigned short port;
-    std::time_t last_time;
-
-    long long uploaded, downloaded, left;
-};
-
 class TorrentTracker : public Socket
 {
-    typedef std::deque<PeerInfo> PeerInfoList;
-    typedef std::map<std::string, PeerInfoList> TorrentPeerInfoMap;
+    typedef std::map<std::string, PeerTable> TorrentPeerInfoMap;
+    typedef std::map<std::string, std::string> TorrentNameMap;
 
     unsigned short port;
     TorrentPeerInfoMap torrent_peers;
+    TorrentNameMap torrent_names;       // maps names to info hashes
     PeerInfo local_peer;
+    char local_record[6];               // compact peer info of local peer
     TorrentSeeder &seeder;
     int update_interval, purge_interval, max_peers_per_torrent;
+    int scrape_interval;
     Queue<TorrentEvent> event_queue;
+    UdpTracker *udp;
+
+    // Cached reply to a scrape of all torrents (bencoded)
+    std::string full_scrape;
+    std::time_t full_scrape_time;
 
     TorrentTracker(int fd, TorrentSeeder &seeder, unsigned port);
 
     void onReadable();
+    void onTimeout();
 
-    bool store(const PeerInfo &peer, bool stopped = false);
+    bool store(const PeerInfo &peer, bool stopped = false, bool completed = false);
+    PeerTable &currentPeers(const char *info_hash);
     std::vector<const PeerInfo*> list(
         const char *omit_id, const char *info_hash, int count );
+    size_t listCompact( const char *omit_id, const char *info_hash,
+                        int count, char *out );
+    bool countPeers( const std::string &info_hash, long long &complete,
+                     long long &incomplete, long long &downloaded );
+    void addScrapeEntry(Dict &files, const std::string &info_hash);
+    const std::string &fullScrape();
 
 public:
     static TorrentTracker *create(TorrentSeeder &seeder, unsigned short port);
@@ -46,6 +54,9 @@ public:
     void removeTorrent(MetaInfo *info);
     void processQueuedEvents();
 
+    // Whether announce and scrape requests are served over UDP
+    inline bool udpEnabled() const { return udp != NULL; }
+
     // Property getter/setters
     inline int updateInterval() { return update_interval; }
     inline void updateInterval(int i) { update_interval = i; }
@@ -53,8 +64,11 @@ public:
     inline void purgeInterval(int i) { purge_interval = i; }
     inline int maxPeersPerTorrent() { return max_peers_per_torrent; }
     inline void maxPeersPerTorrent(int i) { max_peers_per_torrent = i; }
+    inline int scrapeInterval() { return scrape_interval; }
+    inline void scrapeInterval(int i) { scrape_interval = i; }
 
     friend class TrackerRequestHandler;
+    friend class UdpTracker;
 };
 
 #endif /* ndef TorrentSeeder_H_INCLUDED */
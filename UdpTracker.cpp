@@ -0,0 +1,268 @@
+#include "UdpTracker.h"
+#include "TorrentTracker.h"
+#include "sha.h"
+
+#ifndef __MINGW32__
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+
+enum Action { action_connect = 0, action_announce = 1,
+              action_scrape = 2, action_error = 3 };
+
+// Identifies connect requests
+static const unsigned long long protocol_id = 0x41727101980ull;
+
+// Number of peers returned if the client doesn't specify it, and the
+// maximum, which keeps replies within a single unfragmented datagram.
+static const unsigned default_peers = 50, max_peers = 200;
+
+// Maximum number of info hashes in a scrape request
+static const size_t max_scrape = 74;
+
+// Maximum number of datagrams handled per call to onReadable()
+static const int max_receives = 64;
+
+static unsigned get32(const char *data)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static unsigned long long get64(const char *data)
+{
+    return ((unsigned long long)get32(data) << 32) | get32(data + 4);
+}
+
+static void put32(char *data, unsigned value)
+{
+    data[0] = value >> 24;
+    data[1] = value >> 16;
+    data[2] = value >>  8;
+    data[3] = value;
+}
+
+static void put64(char *data, unsigned long long value)
+{
+    put32(data, value >> 32);
+    put32(data + 4, value);
+}
+
+UdpTracker::UdpTracker(TorrentTracker &tracker, SocketSet &set, int fd)
+    : Socket(set, fd, readable), tracker(tracker)
+{
+    setNonBlocking();
+
+    // Choose a secret for connection ids
+    int random = open("/dev/urandom", O_RDONLY);
+    if(random < 0 || read(random, secret, sizeof(secret)) != sizeof(secret))
+    {
+        for(size_t n = 0; n < sizeof(secret); ++n)
+            secret[n] = std::rand();
+    }
+    if(random >= 0)
+        close(random);
+}
+
+UdpTracker::~UdpTracker()
+{
+}
+
+// Creates a UDP socket bound to the given port (normally the port of the
+// tracker's TCP socket). Returns NULL on failure.
+UdpTracker *UdpTracker::create(TorrentTracker &tracker, unsigned short port)
+{
+    int fd = socket(PF_INET, SOCK_DGRAM, 0);
+    if(fd < 0)
+        return NULL;
+
+    struct sockaddr_in addr = { };
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = 0;
+    addr.sin_port = htons(port);
+    if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    return new UdpTracker(tracker, tracker.set(), fd);
+}
+
+unsigned long long UdpTracker::connectionId(
+    unsigned ip, unsigned short port, unsigned long minute ) const
+{
+    char data[10];
+    std::memcpy(data, &ip, 4);
+    data[4] = port >> 8;
+    data[5] = port;
+    put32(data + 6, minute);
+
+    class SHA1 hash;
+    unsigned char digest[20];
+    hash.add(secret, sizeof(secret));
+    hash.add(data, sizeof(data));
+    hash.finish(digest);
+    return get64((const char *)digest);
+}
+
+// Connection ids are accepted for up to two minutes after they are issued
+bool UdpTracker::validConnectionId(
+    unsigned ip, unsigned short port, unsigned long long id ) const
+{
+    unsigned long minute = std::time(NULL)/60;
+    return id == connectionId(ip, port, minute) ||
+           id == connectionId(ip, port, minute - 1);
+}
+
+void UdpTracker::onReadable()
+{
+    for(int n = 0; n < max_receives; ++n)
+    {
+        char request[2048], reply[20 + 6*max_peers];
+        sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        ssize_t size = recvfrom( fd, request, sizeof(request), 0,
+                                 (sockaddr*)&addr, &addr_len );
+        if(size < 0)
+        {
+            if( errno != EAGAIN && errno != EWOULDBLOCK &&
+                errno != EINTR && errno != ECONNREFUSED )
+                perror("recvfrom");
+            break;
+        }
+        if(size < 16)
+            continue;
+
+        unsigned ip = addr.sin_addr.s_addr;
+        unsigned short port = ntohs(addr.sin_port);
+        unsigned long long connection_id = get64(request);
+        unsigned action = get32(request + 8);
+
+        size_t reply_size;
+        if(action == action_connect)
+        {
+            if(connection_id != protocol_id)
+                continue;
+            reply_size = handleConnect(ip, port, request, reply);
+        }
+        else
+        if(!validConnectionId(ip, port, connection_id))
+        {
+            reply_size = error(request, "Invalid connection id", reply);
+        }
+        else
+        if(action == action_announce)
+            reply_size = handleAnnounce(ip, request, size, reply);
+        else
+        if(action == action_scrape)
+            reply_size = handleScrape(request, size, reply);
+        else
+            reply_size = error(request, "Invalid action", reply);
+
+        // Replies that cannot be sent now are retried by the client
+        sendto(fd, reply, reply_size, 0, (sockaddr*)&addr, addr_len);
+    }
+}
+
+size_t UdpTracker::handleConnect(
+    unsigned ip, unsigned short port, const char *request, char *reply )
+{
+    put32(reply, action_connect);
+    std::memcpy(reply + 4, request + 12, 4);
+    put64(reply + 8, connectionId(ip, port, std::time(NULL)/60));
+    return 16;
+}
+
+size_t UdpTracker::handleAnnounce(
+    unsigned ip, const char *request, size_t size, char *reply )
+{
+    if(size < 98)
+        return error(request, "Bad request", reply);
+
+    std::string info_hash(request + 16, 20);
+    if(tracker.torrent_peers.find(info_hash) == tracker.torrent_peers.end())
+        return error(request, "Forbidden", reply);
+
+    // Construct peer info
+    PeerInfo peer;
+    std::memcpy(peer.info_hash, request + 16, 20);
+    std::memcpy(peer.peer_id, request + 36, 20);
+    peer.ip         = ip;
+    peer.port       = ((unsigned char)request[96] << 8) | (unsigned char)request[97];
+    peer.downloaded = get64(request + 56);
+    peer.left       = get64(request + 64);
+    peer.uploaded   = get64(request + 72);
+    unsigned event  = get32(request + 80);
+    unsigned want   = get32(request + 92);
+    if(want == 0xffffffffu)
+        want = default_peers;
+    if(want > max_peers)
+        want = max_peers;
+
+    // Store peer state (event 1 means the peer completed, 3 that it stopped)
+    tracker.store(peer, peer.port == 0 || event == 3, event == 1);
+
+    long long complete, incomplete, downloaded;
+    tracker.countPeers(info_hash, complete, incomplete, downloaded);
+
+    put32(reply, action_announce);
+    std::memcpy(reply + 4, request + 12, 4);
+    put32(reply + 8, tracker.update_interval);
+    put32(reply + 12, incomplete);
+    put32(reply + 16, complete);
+    return 20 + tracker.listCompact(peer.peer_id, peer.info_hash, want, reply + 20);
+}
+
+size_t UdpTracker::handleScrape(const char *request, size_t size, char *reply)
+{
+    size_t hashes = std::min((size - 16)/20, max_scrape);
+
+    put32(reply, action_scrape);
+    std::memcpy(reply + 4, request + 12, 4);
+    for(size_t n = 0; n < hashes; ++n)
+    {
+        long long complete, incomplete, downloaded;
+        tracker.countPeers( std::string(request + 16 + 20*n, 20),
+                            complete, incomplete, downloaded );
+        put32(reply + 8 + 12*n, complete);
+        put32(reply + 12 + 12*n, downloaded);
+        put32(reply + 16 + 12*n, incomplete);
+    }
+    return 8 + 12*hashes;
+}
+
+size_t UdpTracker::error(const char *request, const char *message, char *reply)
+{
+    size_t length = std::strlen(message);
+    put32(reply, action_error);
+    std::memcpy(reply + 4, request + 12, 4);
+    std::memcpy(reply + 8, message, length);
+    return 8 + length;
+}
+
+#else /* def __MINGW32__ */
+
+UdpTracker *UdpTracker::create(TorrentTracker &tracker, unsigned short port)
+{
+    return NULL;
+}
+
+UdpTracker::~UdpTracker()
+{
+}
+
+void UdpTracker::onReadable()
+{
+}
+
+#endif /* ndef __MINGW32__ */
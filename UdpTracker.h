@@ -0,0 +1,39 @@
+#ifndef UDPTRACKER_H_INCLUDED
+#define UDPTRACKER_H_INCLUDED
+
+#include "Socket.h"
+
+class TorrentTracker;
+
+// Serves announce and scrape requests using the UDP tracker protocol
+// (BEP 15), which avoids setting up a TCP connection per request. Peers
+// are stored and listed by the TorrentTracker, like HTTP requests.
+//
+// Connection ids are derived from the client's address, the current minute
+// and a random secret, so no state needs to be kept between requests.
+class UdpTracker : public Socket
+{
+    TorrentTracker &tracker;
+    unsigned char secret[16];
+
+    UdpTracker(TorrentTracker &tracker, SocketSet &set, int fd);
+
+    void onReadable();
+
+    unsigned long long connectionId( unsigned ip, unsigned short port,
+                                     unsigned long minute ) const;
+    bool validConnectionId( unsigned ip, unsigned short port,
+                            unsigned long long id ) const;
+    size_t handleConnect( unsigned ip, unsigned short port,
+                          const char *request, char *reply );
+    size_t handleAnnounce( unsigned ip, const char *request, size_t size,
+                           char *reply );
+    size_t handleScrape( const char *request, size_t size, char *reply );
+    size_t error(const char *request, const char *message, char *reply);
+
+public:
+    static UdpTracker *create(TorrentTracker &tracker, unsigned short port);
+    ~UdpTracker();
+};
+
+#endif /* ndef UDPTRACKER_H_INCLUDED */
@@ -0,0 +1,696 @@
+#include "UtpSocket.h"
+#include "TorrentSeeder.h"
+
+#ifndef __MINGW32__
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+
+enum PacketType { st_data = 0, st_fin = 1, st_state = 2, st_reset = 3, st_syn = 4 };
+
+struct UtpHeader
+{
+    int type;
+    unsigned short connection_id;
+    unsigned timestamp, timestamp_difference, wnd_size;
+    unsigned short seq_nr, ack_nr;
+};
+
+static const size_t header_size = 20;
+
+// Maximum payload per packet; keeps packets below common path MTUs
+static const size_t max_payload = 1380;
+
+// Congestion window limits and initial size (in bytes)
+static const double min_window = max_payload;
+static const double max_window = 1 << 20;
+static const double initial_window = 4*max_payload;
+
+// Maximum number of received bytes buffered per connection
+static const size_t receive_buffer = 1 << 20;
+
+// LEDBAT parameters: the queueing delay aimed for (in microseconds), and
+// the maximum window growth per round trip (in bytes).
+static const unsigned target_delay = 100000;
+static const double max_cwnd_increase = 3000;
+
+// Packets received this far ahead of the next expected one are dropped
+static const unsigned short max_reorder = 1024;
+
+// Retransmission timeouts (in milliseconds), and the number of consecutive
+// timeouts after which a connection is reset
+static const unsigned initial_rto = 1000, min_rto = 500, max_rto = 60000;
+static const unsigned max_timeouts = 8;
+
+// Maximum number of packets received per call to onReadable()
+static const int max_receives = 64;
+
+// Send buffer size of the local end used by the TorrentPeer. Kept small, so
+// that the peer's backlog and upload rate reflect what is actually sent.
+static const int local_send_buffer = 65536;
+
+// Timestamps come from a monotonic clock, so changes to the system time
+// don't disturb delay and round-trip time measurements.
+static unsigned long long now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return 1000000ull*ts.tv_sec + ts.tv_nsec/1000;
+}
+
+static unsigned get16(const Byte *buffer)
+{
+    const unsigned char *b = (const unsigned char*)buffer;
+    return b[0] << 8 | b[1];
+}
+
+static unsigned get32(const Byte *buffer)
+{
+    const unsigned char *b = (const unsigned char*)buffer;
+    return (unsigned)b[0] << 24 | b[1] << 16 | b[2] << 8 | b[3];
+}
+
+static void put16(Byte *p, unsigned i)
+{
+    p[0] = i >> 8;
+    p[1] = i;
+}
+
+static void put32(Byte *p, unsigned i)
+{
+    p[0] = i >> 24;
+    p[1] = i >> 16;
+    p[2] = i >> 8;
+    p[3] = i;
+}
+
+// Parses a packet header. On success, the offset of the payload (after any
+// extensions, which are skipped) is stored in `offset'.
+static bool parse_header( const Byte *buffer, size_t size,
+                          UtpHeader &header, size_t &offset )
+{
+    const unsigned char *data = (const unsigned char*)buffer;
+    if(size < header_size || (data[0] & 15) != 1 || (data[0] >> 4) > st_syn)
+        return false;
+
+    header.type                 = data[0] >> 4;
+    header.connection_id        = get16(buffer + 2);
+    header.timestamp            = get32(buffer + 4);
+    header.timestamp_difference = get32(buffer + 8);
+    header.wnd_size             = get32(buffer + 12);
+    header.seq_nr               = get16(buffer + 16);
+    header.ack_nr               = get16(buffer + 18);
+
+    offset = header_size;
+    for(unsigned extension = data[1]; extension != 0; )
+    {
+        if(offset + 2 > size)
+            return false;
+        extension = data[offset];
+        offset += 2 + data[offset + 1];
+    }
+    return offset <= size;
+}
+
+static void put_header( Byte *p, int type, unsigned short connection_id,
+                        unsigned timestamp_difference, unsigned wnd_size,
+                        unsigned short seq_nr, unsigned short ack_nr )
+{
+    p[0] = type << 4 | 1;
+    p[1] = 0;
+    put16(p + 2, connection_id);
+    put32(p + 4, (unsigned)now_us());
+    put32(p + 8, timestamp_difference);
+    put32(p + 12, wnd_size);
+    put16(p + 16, seq_nr);
+    put16(p + 18, ack_nr);
+}
+
+static unsigned long long connection_key( unsigned address,
+    unsigned short port, unsigned short connection_id )
+{
+    return (unsigned long long)address << 32 |
+           (unsigned long long)port << 16 | connection_id;
+}
+
+//
+//  UtpConnection
+//
+
+UtpConnection::UtpConnection( UtpSocket &utp, SocketSet &set, int fd,
+                              unsigned address, unsigned short port,
+                              const UtpHeader &syn )
+    : Socket(set, fd, readable), utp(utp), address(address), port(port),
+      recv_id(syn.connection_id + 1), send_id(syn.connection_id),
+      seq_nr(std::rand()), ack_nr(syn.seq_nr),
+      reply_delay((unsigned)now_us() - syn.timestamp),
+      flight(0), cwnd(initial_window), ssthresh(max_window),
+      slow_start(true), peer_window(syn.wnd_size), rtt(0), rtt_var(0),
+      rto(initial_rto), duplicate_acks(0), timeouts(0), recovering(false),
+      recover_nr(0),
+      base_delay_time(std::time(NULL)), eof(false), reorder_bytes(0),
+      has_fin(false), fin_received(false), fin_seq(0), finished(false)
+{
+    setNonBlocking();
+    base_delay[0] = base_delay[1] = (unsigned)-1;
+    sendState();
+}
+
+UtpConnection::~UtpConnection()
+{
+    utp.connections.erase(connection_key(address, port, recv_id));
+    utp.seeder.releaseDescriptor();
+}
+
+void UtpConnection::destroy(bool reset)
+{
+    if(reset)
+        utp.sendReset(address, port, send_id, ack_nr);
+    delete this;
+}
+
+// Local data is available
+void UtpConnection::onReadable()
+{
+    sendData();
+}
+
+// The local end can accept more received data
+void UtpConnection::onWritable()
+{
+    flushReceived();
+}
+
+// Retransmission timeout: all packets in flight are presumed lost, and the
+// window shrinks to a single packet.
+void UtpConnection::onTimeout()
+{
+    if(unacked.empty())
+        return;
+
+    if(++timeouts > max_timeouts)
+    {
+        destroy(true);
+        return;
+    }
+
+    for(std::deque<Packet>::iterator i = unacked.begin(); i != unacked.end(); ++i)
+        i->resend = true;
+    flight = 0;
+    recovering = false;
+    ssthresh = std::max(cwnd/2, min_window);
+    cwnd = min_window;
+    slow_start = true;
+    rto = std::min(2*rto, max_rto);
+
+    // Sends the first packet again, and rearms the timer
+    sendData();
+}
+
+// Handles a packet received for this connection
+void UtpConnection::receive( const UtpHeader &header,
+                             const Byte *payload, size_t size )
+{
+    reply_delay = (unsigned)now_us() - header.timestamp;
+    peer_window = header.wnd_size;
+
+    if(header.type == st_reset)
+    {
+        destroy(false);
+        return;
+    }
+
+    if(header.type == st_syn)
+    {
+        // Our reply was lost
+        sendState();
+        return;
+    }
+
+    processAck(header);
+
+    bool ack_needed = false;
+    if(header.type == st_data || header.type == st_fin)
+    {
+        if(header.type == st_fin && !has_fin)
+        {
+            has_fin = true;
+            fin_seq = header.seq_nr;
+        }
+        processData(header.seq_nr, payload, header.type == st_data ? size : 0);
+        ack_needed = true;
+    }
+
+    if(finished)
+    {
+        destroy(false);
+        return;
+    }
+
+    // Data packets carry acknowledgements too
+    if(!sendData() && ack_needed)
+        sendState();
+}
+
+// Removes acknowledged packets, and adjusts the window
+void UtpConnection::processAck(const UtpHeader &header)
+{
+    if(unacked.empty())
+        return;
+
+    unsigned short first = seq_nr - unacked.size();
+    unsigned short count = header.ack_nr - first + 1;
+    if(count == 0)
+    {
+        // After three duplicate acknowledgements, the first packet is
+        // presumed lost, and sent again at once. Recovery lasts until all
+        // packets sent so far are acknowledged.
+        if( header.type == st_state && ++duplicate_acks == 3 &&
+            !recovering && !unacked.front().resend )
+        {
+            transmit(unacked.front());
+            cwnd = ssthresh = std::max(cwnd/2, min_window);
+            slow_start = false;
+            recovering = true;
+            recover_nr = seq_nr - 1;
+        }
+        return;
+    }
+    if(count > unacked.size())
+        return;     // old acknowledgement
+
+    size_t flight_before = flight, bytes_acked = 0;
+    unsigned long long now = now_us();
+    for( ; count > 0; --count)
+    {
+        const Packet &packet = unacked.front();
+        size_t payload = packet.data.size() - header_size;
+        bytes_acked += payload;
+        if(!packet.resend)
+            flight -= payload;
+
+        if(packet.transmissions == 1)
+        {
+            // Round trip time estimate, as for TCP (RFC 6298)
+            unsigned sample = now - packet.sent;
+            if(rtt == 0)
+            {
+                rtt = sample;
+                rtt_var = sample/2;
+            }
+            else
+            {
+                int error = int(sample) - int(rtt);
+                rtt_var += (std::abs(error) - int(rtt_var))/4;
+                rtt += error/8;
+            }
+        }
+        unacked.pop_front();
+    }
+    duplicate_acks = 0;
+    timeouts = 0;
+    if(rtt != 0)
+        rto = std::max((rtt + 4*rtt_var)/1000, min_rto);
+
+    if(recovering)
+    {
+        // A partial acknowledgement during recovery reveals the next loss
+        unsigned short left = recover_nr - header.ack_nr;
+        if(left != 0 && left < 0x8000)
+            transmit(unacked.front());
+        else
+            recovering = false;
+    }
+
+    updateWindow(bytes_acked, flight_before, header.timestamp_difference);
+
+    if(!unacked.empty())
+        setTimer(rto);
+    else
+    {
+        disarm();
+        if(eof)
+            finished = true;    // our FIN was acknowledged
+    }
+}
+
+// Adjusts the congestion window with LEDBAT: it grows while the one-way
+// delay of our packets stays near its minimum, and shrinks as queues build
+// up on the path.
+void UtpConnection::updateWindow( size_t bytes_acked, size_t flight_before,
+                                  unsigned delay )
+{
+    if(bytes_acked == 0 || delay == 0)
+        return;
+
+    // The base delay (the minimum over the last one to two minutes) is the
+    // delay without queueing, offset by the difference between clocks.
+    std::time_t t = std::time(NULL);
+    if(t - base_delay_time >= 60)
+    {
+        base_delay[1] = base_delay[0];
+        base_delay[0] = delay;
+        base_delay_time = t;
+    }
+    base_delay[0] = std::min(base_delay[0], delay);
+    double queueing = delay - std::min(base_delay[0], base_delay[1]);
+
+    double off_target = (target_delay - queueing)/target_delay;
+    double window_factor = std::min(bytes_acked, flight_before)/
+                           std::max(cwnd, double(bytes_acked));
+    double gain = max_cwnd_increase*window_factor*off_target;
+
+    if(slow_start)
+    {
+        if(queueing > 0.9*target_delay || cwnd + bytes_acked > ssthresh)
+            slow_start = false;
+        else
+            gain = std::max(gain, double(bytes_acked));
+    }
+    cwnd = std::max(min_window, std::min(max_window, cwnd + gain));
+}
+
+// Handles a data packet (or FIN packet, with an empty payload)
+void UtpConnection::processData( unsigned short seq,
+                                 const Byte *payload, size_t size )
+{
+    unsigned short ahead = seq - (unsigned short)(ack_nr + 1);
+    if(ahead >= max_reorder)
+        return;     // duplicate
+
+    if(ahead == 0 && !(has_fin && seq == fin_seq))
+    {
+        deliver(payload, size);
+        ack_nr = seq;
+    }
+    else
+    if( ahead > 0 && size > 0 && reorder_bytes + size <= receive_buffer &&
+        reorder.insert(std::make_pair(seq, ByteBuffer(payload, payload + size))).second )
+    {
+        reorder_bytes += size;
+    }
+
+    // Continue with packets received out of order
+    while(!fin_received)
+    {
+        unsigned short next = ack_nr + 1;
+        if(has_fin && next == fin_seq)
+        {
+            ack_nr = next;
+            fin_received = true;
+            break;
+        }
+
+        std::map<unsigned short, ByteBuffer>::iterator i = reorder.find(next);
+        if(i == reorder.end())
+            break;
+        deliver(&i->second[0], i->second.size());
+        reorder_bytes -= i->second.size();
+        reorder.erase(i);
+        ack_nr = next;
+    }
+
+    flushReceived();
+}
+
+void UtpConnection::deliver(const Byte *data, size_t size)
+{
+    received.insert(received.end(), data, data + size);
+}
+
+// Writes received data to the local end. After the peer's FIN, the local
+// end is shut down for writing, so the TorrentPeer reads end-of-stream.
+void UtpConnection::flushReceived()
+{
+    if(!received.empty())
+    {
+        ssize_t bytes = write(fd, &received[0], received.size());
+        if(bytes > 0)
+            received.erase(received.begin(), received.begin() + bytes);
+        else
+        if(bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            received.clear();   // local end closed; data is not needed
+    }
+
+    if(!received.empty())
+        setMask(mask() | writable);
+    else
+    {
+        setMask(mask() & ~writable);
+        if(fin_received)
+            shutdown(fd, SHUT_WR);
+    }
+}
+
+// Sends packets presumed lost again, then new local data, as far as the
+// window allows. Returns whether anything was sent.
+bool UtpConnection::sendData()
+{
+    size_t window = std::min(size_t(cwnd), size_t(peer_window));
+    bool sent = false, blocked = false;
+
+    for( std::deque<Packet>::iterator i = unacked.begin();
+         i != unacked.end() && !blocked; ++i )
+    {
+        if(!i->resend)
+            continue;
+        size_t payload = i->data.size() - header_size;
+        if(flight > 0 && flight + payload > window)
+        {
+            blocked = true;
+            break;
+        }
+        transmit(*i);
+        i->resend = false;
+        flight += payload;
+        sent = true;
+    }
+
+    while(!eof && !blocked)
+    {
+        size_t room = window > flight ? window - flight : 0;
+        if(room == 0 || (room < max_payload && flight > 0))
+        {
+            blocked = true;
+            break;
+        }
+
+        Byte buffer[max_payload];
+        ssize_t bytes = read(fd, buffer, std::min(room, max_payload));
+        if(bytes > 0)
+            queuePacket(st_data, buffer, bytes);
+        else
+        if(bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            break;
+        else
+        {
+            // Local end closed (or failed)
+            eof = true;
+            queuePacket(st_fin, NULL, 0);
+        }
+        sent = true;
+    }
+
+    // Local data is only read while it can be sent
+    setMask(eof || blocked ? mask() & ~readable : mask() | readable);
+
+    if(!unacked.empty() && !armed())
+        setTimer(rto);
+    return sent;
+}
+
+// Sends a new data or FIN packet
+void UtpConnection::queuePacket(int type, const Byte *payload, size_t size)
+{
+    unacked.push_back(Packet());
+    Packet &packet = unacked.back();
+    packet.type = type;
+    packet.seq_nr = seq_nr++;
+    packet.data.resize(header_size + size);
+    std::copy(payload, payload + size, packet.data.begin() + header_size);
+    packet.sent = 0;
+    packet.transmissions = 0;
+    packet.resend = false;
+    transmit(packet);
+    flight += size;
+}
+
+// Sends a packet, with up-to-date timestamps and acknowledgement
+void UtpConnection::transmit(Packet &packet)
+{
+    put_header( &packet.data[0], packet.type, send_id, reply_delay,
+                receiveWindow(), packet.seq_nr, ack_nr );
+    utp.send(address, port, &packet.data[0], packet.data.size());
+    packet.sent = now_us();
+    ++packet.transmissions;
+}
+
+// Sends an acknowledgement
+void UtpConnection::sendState()
+{
+    Byte header[header_size];
+    put_header( header, st_state, send_id, reply_delay, receiveWindow(),
+                seq_nr, ack_nr );
+    utp.send(address, port, header, header_size);
+}
+
+unsigned UtpConnection::receiveWindow() const
+{
+    size_t used = received.size() + reorder_bytes;
+    return used < receive_buffer ? receive_buffer - used : 0;
+}
+
+//
+//  UtpSocket
+//
+
+UtpSocket::UtpSocket(TorrentSeeder &seeder, SocketSet &set, int fd)
+    : Socket(set, fd, readable), seeder(seeder)
+{
+    setNonBlocking();
+}
+
+UtpSocket::~UtpSocket()
+{
+    while(!connections.empty())
+        delete connections.begin()->second;
+}
+
+// Creates a UDP socket bound to the given port (normally the port of the
+// seeder's TCP socket). Returns NULL on failure.
+UtpSocket *UtpSocket::create( TorrentSeeder &seeder, SocketSet &set,
+                              unsigned short port )
+{
+    int fd = socket(PF_INET, SOCK_DGRAM, 0);
+    if(fd < 0)
+        return NULL;
+
+    struct sockaddr_in addr = { };
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = 0;
+    addr.sin_port = htons(port);
+    if(bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    return new UtpSocket(seeder, set, fd);
+}
+
+// Receives pending packets, and passes them to their connections
+void UtpSocket::onReadable()
+{
+    for(int n = 0; n < max_receives; ++n)
+    {
+        Byte buffer[2048];
+        sockaddr_in addr;
+        socklen_t addr_len = sizeof(addr);
+        ssize_t size = recvfrom( fd, buffer, sizeof(buffer), 0,
+                                 (sockaddr*)&addr, &addr_len );
+        if(size < 0)
+        {
+            if( errno != EAGAIN && errno != EWOULDBLOCK &&
+                errno != EINTR && errno != ECONNREFUSED )
+                perror("recvfrom");
+            break;
+        }
+
+        UtpHeader header;
+        size_t offset;
+        if(!parse_header(buffer, size, header, offset))
+            continue;
+
+        unsigned address = ntohl(addr.sin_addr.s_addr);
+        unsigned short port = ntohs(addr.sin_port);
+
+        // A SYN carries the initiator's receive id; we receive on the next
+        unsigned short id = header.connection_id + (header.type == st_syn);
+        std::map<unsigned long long, UtpConnection*>::iterator i =
+            connections.find(connection_key(address, port, id));
+        if(i != connections.end())
+            i->second->receive(header, buffer + offset, size - offset);
+        else
+        if(header.type == st_syn)
+            accept(address, port, header);
+        else
+        if(header.type != st_reset)
+            sendReset(address, port, header.connection_id - 1, header.seq_nr);
+    }
+}
+
+// Sets up a connection, if the seeder admits it, and passes the other end
+// of its socket pair to a seeder thread. Both ends count against the
+// seeder's descriptor limit.
+void UtpSocket::accept( unsigned address, unsigned short port,
+                        const UtpHeader &syn )
+{
+    if(!seeder.admitPeer(address, 2))
+    {
+        sendReset(address, port, syn.connection_id, syn.seq_nr);
+        return;
+    }
+
+    int fds[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+    {
+        perror("socketpair");
+        seeder.releasePeer(address);
+        seeder.releaseDescriptor();
+        return;
+    }
+    fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+    setsockopt( fds[1], SOL_SOCKET, SO_SNDBUF,
+                &local_send_buffer, sizeof(local_send_buffer) );
+
+    UtpConnection *connection =
+        new UtpConnection(*this, set(), fds[0], address, port, syn);
+    connections[connection_key(address, port, connection->recv_id)] = connection;
+    seeder.dispatchConnection(fds[1], address);
+}
+
+void UtpSocket::send( unsigned address, unsigned short port,
+                      const Byte *data, size_t size )
+{
+    struct sockaddr_in addr = { };
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(address);
+    addr.sin_port = htons(port);
+
+    // Packets that cannot be sent now are treated as lost
+    sendto(fd, data, size, 0, (struct sockaddr*)&addr, sizeof(addr));
+}
+
+void UtpSocket::sendReset( unsigned address, unsigned short port,
+                           unsigned short connection_id, unsigned short ack_nr )
+{
+    Byte header[header_size];
+    put_header(header, st_reset, connection_id, 0, 0, std::rand(), ack_nr);
+    send(address, port, header, header_size);
+}
+
+#else /* def __MINGW32__ */
+
+UtpSocket *UtpSocket::create( TorrentSeeder &seeder, SocketSet &set,
+                              unsigned short port )
+{
+    return NULL;
+}
+
+UtpSocket::~UtpSocket()
+{
+}
+
+void UtpSocket::onReadable()
+{
+}
+
+#endif /* ndef __MINGW32__ */
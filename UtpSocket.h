@@ -0,0 +1,111 @@
+#ifndef UTPSOCKET_H_INCLUDED
+#define UTPSOCKET_H_INCLUDED
+
+#include "MetaInfo.h"
+#include "Socket.h"
+#include <deque>
+#include <map>
+#include <ctime>
+
+class TorrentSeeder;
+class UtpSocket;
+struct UtpHeader;
+
+// A connection using the Micro Transport Protocol (BEP 29). Data is
+// exchanged with the TorrentPeer serving the connection through a local
+// socket pair, so peers are served the same way regardless of transport.
+// This object owns the other end of the pair: data read from it is sent
+// as it fits in the congestion window, which is managed with LEDBAT, so
+// uploads yield to other traffic.
+class UtpConnection : public Socket
+{
+    friend class UtpSocket;
+
+    struct Packet
+    {
+        int type;
+        unsigned short seq_nr;
+        ByteBuffer data;                // header and payload
+        unsigned long long sent;        // time of last transmission (us)
+        unsigned transmissions;
+        bool resend;                    // presumed lost
+    };
+
+    UtpSocket &utp;
+    unsigned address;                   // IPv4 address (host order)
+    unsigned short port, recv_id, send_id;
+    unsigned short seq_nr;              // sequence number of next packet
+    unsigned short ack_nr;              // last packet received in order
+    unsigned reply_delay;               // timestamp difference to report
+
+    // Sending
+    std::deque<Packet> unacked;         // sequence numbers up to seq_nr - 1
+    size_t flight;                      // payload bytes in flight
+    double cwnd, ssthresh;
+    bool slow_start;
+    unsigned peer_window;
+    unsigned rtt, rtt_var, rto;         // rtt in microseconds, rto in ms
+    unsigned duplicate_acks, timeouts;
+    bool recovering;                    // after a fast retransmit
+    unsigned short recover_nr;          // last packet sent before it
+    unsigned base_delay[2];             // minimum delay this and last minute
+    std::time_t base_delay_time;
+    bool eof;                           // local end closed; FIN queued
+
+    // Receiving
+    ByteBuffer received;                // to be written to the local end
+    std::map<unsigned short, ByteBuffer> reorder;
+    size_t reorder_bytes;
+    bool has_fin, fin_received;
+    unsigned short fin_seq;
+    bool finished;
+
+    UtpConnection( UtpSocket &utp, SocketSet &set, int fd,
+                   unsigned address, unsigned short port,
+                   const UtpHeader &syn );
+    ~UtpConnection();
+
+    void onReadable();
+    void onWritable();
+    void onTimeout();
+
+    void receive(const UtpHeader &header, const Byte *payload, size_t size);
+    void processAck(const UtpHeader &header);
+    void processData(unsigned short seq, const Byte *payload, size_t size);
+    void updateWindow(size_t bytes_acked, size_t flight_before, unsigned delay);
+    void deliver(const Byte *data, size_t size);
+    void flushReceived();
+    bool sendData();
+    void queuePacket(int type, const Byte *payload, size_t size);
+    void transmit(Packet &packet);
+    void sendState();
+    unsigned receiveWindow() const;
+    void destroy(bool reset);
+};
+
+// The UDP socket on which uTP packets are received for all connections.
+// New connections are admitted and handed to seeder threads like TCP
+// connections.
+class UtpSocket : public Socket
+{
+    friend class UtpConnection;
+
+    TorrentSeeder &seeder;
+    std::map<unsigned long long, UtpConnection*> connections;
+
+    UtpSocket(TorrentSeeder &seeder, SocketSet &set, int fd);
+
+    void onReadable();
+    void accept(unsigned address, unsigned short port, const UtpHeader &syn);
+    void send( unsigned address, unsigned short port,
+               const Byte *data, size_t size );
+    void sendReset( unsigned address, unsigned short port,
+                    unsigned short connection_id, unsigned short ack_nr );
+
+public:
+    static UtpSocket *create( TorrentSeeder &seeder, SocketSet &set,
+                              unsigned short port );
+    ~UtpSocket();
+};
+
+#endif /* ndef UTPSOCKET_H_INCLUDED */
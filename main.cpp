@@ -38,26 +38,12 @@ void run_directory_thread(void *arg)
 
 void run_main_thread()
 {
-    // FIXME: make seeder use absolute paths, if that's not too slow
-    chdir(cfg_data_dir.c_str());
-
-    int last_time = time(0) - 1;
-    unsigned exceeded = 0;
-    while(socket_set.process(250))
+    while(socket_set.process(seeder->timeout()))
     {
         tracker->processQueuedEvents();
 
-        // Queue upload data
-        for(int t = time(NULL); last_time < t; ++last_time)
-        {
-            if(exceeded >= cfg_upload_rate)
-                exceeded -= cfg_upload_rate;
-            else
-            {
-                unsigned queued = seeder->queueUploadData(cfg_upload_rate - exceeded);
-                exceeded = (queued > cfg_upload_rate) ? (queued - cfg_upload_rate) : 0;
-            }
-        }
+        // Resume uploads to peers served by the main thread
+        seeder->processUploads();
     }
 }
 
@@ -89,6 +75,17 @@ int main()
         std::cerr << "WARNING: no configuration files found - using only default values!" << std::endl;
     }
 
+    // Seed the random number generator, which randomizes the hashing of
+    // peer ids, the peers returned by the tracker and uTP sequence numbers.
+    unsigned seed = time(0) ^ getpid();
+    if(FILE *fp = std::fopen("/dev/urandom", "rb"))
+    {
+        if(std::fread(&seed, sizeof(seed), 1, fp) != 1)
+            seed = time(0) ^ getpid();
+        std::fclose(fp);
+    }
+    srand(seed);
+
     // Create seeder
     if(!(seeder = TorrentSeeder::create(socket_set)))
     {
@@ -103,32 +100,42 @@ int main()
         return 1;
     }
 
-    // Get announce URL
-    std::string announce;
-    if(!cfg_announce_url.empty())
-    {
-        announce = cfg_announce_url;
-    }
-    else
+    // Get announce and web seed URLs
+    std::string announce = cfg_announce_url, udp_announce = cfg_udp_announce_url,
+                web_seed = cfg_web_seed_url;
+    if( announce.empty() || (tracker->udpEnabled() && udp_announce.empty()) ||
+        (cfg_web_seed && web_seed.empty()) )
     {
-        // Generate announce URL from hostname
+        // Generate URLs from hostname
         std::string hostname;
         if(!hostName(hostname))
         {
             std::perror("lookup hostname");
             return 1;
         }
-        std::ostringstream anounce_ss;
-        anounce_ss << "http://" << hostname;
+        std::ostringstream base_ss;
+        base_ss << "http://" << hostname;
         if(cfg_tracker_port != 80)
-            anounce_ss << ":" << cfg_tracker_port;
-        anounce_ss << "/announce";
-        announce = anounce_ss.str();
+            base_ss << ":" << cfg_tracker_port;
+        if(announce.empty())
+            announce = base_ss.str() + "/announce";
+        if(cfg_web_seed && web_seed.empty())
+            web_seed = base_ss.str() + "/data/";
+        if(tracker->udpEnabled() && udp_announce.empty())
+        {
+            std::ostringstream udp_ss;
+            udp_ss << "udp://" << hostname << ":" << cfg_tracker_port << "/announce";
+            udp_announce = udp_ss.str();
+        }
     }
+    std::vector<std::string> announce_urls;
+    if(tracker->udpEnabled())
+        announce_urls.push_back(udp_announce);
+    announce_urls.push_back(announce);
 
     // Create directory
-    directory = new TorrentDirectory(
-        *tracker, cfg_data_dir.c_str(), cfg_metadata_dir.c_str(), announce );
+    directory = new TorrentDirectory( *tracker,
+        cfg_data_dir.c_str(), cfg_metadata_dir.c_str(), announce_urls, web_seed );
 
     // Block unwanted PIPE signal (sent when writing to a closed socket)
     /* Note: it's important to do this before any threads are created, so they inherit
@@ -140,6 +147,7 @@ int main()
 
     // Start up.
     omni_thread::create(run_directory_thread, directory);
+    seeder->start();
     run_main_thread();
     return 1;
 }
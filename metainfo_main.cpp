@@ -36,7 +36,8 @@ int main(int argc, char *argv[])
     std::string announce = anounce_ss.str();
 
     // TODO: get piece size from command line
-    MetaInfo *info = MetaInfo::generate(realPath(input.c_str()), announce);
+    MetaInfo *info = MetaInfo::generate( realPath(input.c_str()),
+                                         std::vector<std::string>(1, announce) );
     if(!info)
     {
         std::cerr << "Could not read files from path \"" << argv[1] << "\"!" << std::endl;
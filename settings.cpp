@@ -5,18 +5,49 @@
 
 // Default settings; see header file for descriptions
 unsigned        cfg_upload_rate                     = 256*1024;  // 256 KiB/s
+unsigned        cfg_upload_rate_per_peer            = 0;
+unsigned        cfg_upload_rate_per_ip              = 0;
+unsigned        cfg_upload_sendfile                 = 1;
+unsigned        cfg_piece_cache_size                = 64 << 20;  // 64 MiB
+unsigned        cfg_peer_output_high                = 256*1024;  // 256 KiB
+unsigned        cfg_peer_output_low                 = 64*1024;   // 64 KiB
+unsigned        cfg_max_pending_output              = 32 << 20;  // 32 MiB
+unsigned        cfg_upload_slots                    = 8;
+unsigned        cfg_choke_interval                  = 10;
+unsigned        cfg_super_seeding                   = 0;
+unsigned        cfg_allowed_fast                    = 10;
+unsigned        cfg_disk_threads                    = 4;
+unsigned        cfg_io_uring_entries                = 0;
+unsigned        cfg_max_open_files                  = 256;
 std::string     cfg_data_dir                        = "data";
 std::string     cfg_metadata_dir                    = "metadata";
 std::string     cfg_announce_url                    = "";
+unsigned        cfg_udp_tracker                     = 1;
+std::string     cfg_udp_announce_url                = "";
+unsigned        cfg_web_seed                        = 1;
+std::string     cfg_web_seed_url                    = "";
 unsigned short  cfg_tracker_port                    = 7000;
 unsigned        cfg_directory_cooldown              = 60;
 unsigned        cfg_directory_update_interval       = 300;
 std::string     cfg_metadata_suffix                 = ".torrent";
 unsigned short  cfg_seeder_port_min                 = 6881;
 unsigned short  cfg_seeder_port_max                 = 6999;
+unsigned        cfg_seeder_threads                  = 1;
+unsigned        cfg_seeder_max_peers                = 1000;
+unsigned        cfg_seeder_max_peers_per_torrent    = 0;
+unsigned        cfg_seeder_max_peers_per_ip         = 8;
+unsigned        cfg_utp                             = 1;
+unsigned        cfg_listen_backlog                  = 128;
+unsigned        cfg_handshake_timeout               = 30;
+unsigned        cfg_peer_timeout                    = 240;
+unsigned        cfg_keep_alive_interval             = 120;
+unsigned        cfg_http_timeout                    = 30;
+unsigned        cfg_http_idle_timeout               = 15;
+unsigned        cfg_http_max_requests               = 100;
 unsigned        cfg_tracker_rerequest_interval      = 90;
 unsigned        cfg_tracker_purge_interval          = 120;
 unsigned        cfg_tracker_max_peers_per_torrent   = 1000;
+unsigned        cfg_tracker_scrape_interval         = 30;
 
 const struct Parameter {
     std::string name;
@@ -27,11 +58,23 @@ const struct Parameter {
 #   define STR(id) DECL(id, String, std::string)
 #   define PRT(id) DECL(id, Port, unsigned short)
 #   define UNS(id) DECL(id, Unsigned, unsigned)
-    UNS(upload_rate), STR(data_dir), STR(metadata_dir), STR(announce_url),
-    PRT(tracker_port), UNS(directory_cooldown), UNS(directory_update_interval),
-    STR(metadata_suffix), PRT(seeder_port_min), PRT(seeder_port_max),
+    UNS(upload_rate), UNS(upload_rate_per_peer), UNS(upload_rate_per_ip),
+    UNS(upload_sendfile), UNS(piece_cache_size), UNS(peer_output_high),
+    UNS(peer_output_low), UNS(max_pending_output),
+    UNS(upload_slots), UNS(choke_interval), UNS(super_seeding),
+    UNS(allowed_fast),
+    UNS(disk_threads), UNS(io_uring_entries),
+    UNS(max_open_files), STR(data_dir), STR(metadata_dir), STR(announce_url),
+    UNS(udp_tracker), STR(udp_announce_url), UNS(web_seed), STR(web_seed_url),
+    PRT(tracker_port), UNS(directory_cooldown),
+    UNS(directory_update_interval), STR(metadata_suffix),
+    PRT(seeder_port_min), PRT(seeder_port_max), UNS(seeder_threads),
+    UNS(seeder_max_peers), UNS(seeder_max_peers_per_torrent),
+    UNS(seeder_max_peers_per_ip), UNS(utp), UNS(listen_backlog),
+    UNS(handshake_timeout), UNS(peer_timeout), UNS(keep_alive_interval),
+    UNS(http_timeout), UNS(http_idle_timeout), UNS(http_max_requests),
     UNS(tracker_rerequest_interval), UNS(tracker_purge_interval),
-    UNS(tracker_max_peers_per_torrent) };
+    UNS(tracker_max_peers_per_torrent), UNS(tracker_scrape_interval) };
 const int num_parameters = sizeof(parameters)/sizeof(*parameters);
 
 #include <iostream> // DEBUG
@@ -3,9 +3,61 @@
 
 #include <string>
 
-// Maximum number of queued bytes per second (excludes protocol overhead)
+// Maximum number of bytes per second sent to all peers together (0 for no
+// limit). Bytes are counted as they are written, including protocol
+// overhead.
 extern unsigned cfg_upload_rate;
 
+// Maximum number of bytes per second sent to a single peer connection, and
+// to all connections from a single IP address (0 for no limit).
+extern unsigned cfg_upload_rate_per_peer;
+extern unsigned cfg_upload_rate_per_ip;
+
+// If nonzero, piece data is sent directly from data files with sendfile()
+// (where supported), instead of being read into memory first.
+extern unsigned cfg_upload_sendfile;
+
+// Maximum number of bytes of piece data kept in memory, shared by all
+// peers. Only used when piece data is not sent with sendfile().
+extern unsigned cfg_piece_cache_size;
+
+// Piece data is read for a peer until this many bytes are queued for it
+// (unsent or being read), and not again before its queue has drained below
+// the low watermark.
+extern unsigned cfg_peer_output_high, cfg_peer_output_low;
+
+// Maximum number of bytes queued for all peers together (0 for no limit).
+extern unsigned cfg_max_pending_output;
+
+// Maximum number of peers uploaded to at the same time (0 for no limit).
+// Peers that download the fastest are preferred; one slot rotates among
+// the others.
+extern unsigned cfg_upload_slots;
+
+// Number of seconds between choking decisions.
+extern unsigned cfg_choke_interval;
+
+// If nonzero, all torrents are super-seeded (BEP 16): pieces are offered
+// to peers one at a time, so that they are uploaded by the swarm rather
+// than by us. A torrent NAME is also super-seeded if the metadata directory
+// contains a file named .NAME.superseed.
+extern unsigned cfg_super_seeding;
+
+// Number of pieces that peers supporting the Fast Extension may download
+// while choked.
+extern unsigned cfg_allowed_fast;
+
+// Number of threads reading piece data from disk. If zero, data is read
+// by the seeder threads themselves.
+extern unsigned cfg_disk_threads;
+
+// Number of io_uring entries used for disk reads. If zero, or if io_uring
+// is not supported, reads are performed by the disk threads.
+extern unsigned cfg_io_uring_entries;
+
+// Maximum number of data files kept open for reading.
+extern unsigned cfg_max_open_files;
+
 // Data directory; all file and directory entries (except those starting
 // with a dot) will be shared.
 extern std::string cfg_data_dir;
@@ -18,6 +70,23 @@ extern std::string cfg_metadata_dir;
 // Announce URL. If empty, it is generated from the tracker's hostname and port.
 extern std::string cfg_announce_url;
 
+// If non-zero, the tracker also serves announce and scrape requests over UDP
+// (BEP 15) on the tracker port.
+extern unsigned cfg_udp_tracker;
+
+// UDP announce URL, listed before the HTTP announce URL in generated metadata
+// files. If empty, it is generated from the tracker's hostname and port (if
+// the UDP tracker is enabled). Not used if the UDP socket can't be created.
+extern std::string cfg_udp_announce_url;
+
+// If non-zero, data files are served over HTTP by the tracker (under /data/),
+// so clients can download from it as a web seed.
+extern unsigned cfg_web_seed;
+
+// Web seed URL added to generated metadata files. If empty, it is generated
+// from the tracker's hostname and port (if web seeding is enabled).
+extern std::string cfg_web_seed_url;
+
 // Port to which the tracker will be bound. Note that if the tracker port is
 // ever changed, all metadata files must be manually removed so they will be
 // regenerated!
@@ -41,6 +110,43 @@ extern std::string cfg_metadata_suffix;
 // Port range on which the seeder is bound.
 extern unsigned short cfg_seeder_port_min, cfg_seeder_port_max;
 
+// Number of threads serving peer connections. New connections are
+// distributed evenly among them, and so is the upload rate.
+extern unsigned cfg_seeder_threads;
+
+// Maximum number of peer connections in total, per torrent and per remote
+// address. Connections beyond these limits are closed immediately.
+// Zero means unlimited. The total (and max_open_files) is lowered at startup
+// if needed to stay within the limit on open file descriptors.
+extern unsigned cfg_seeder_max_peers, cfg_seeder_max_peers_per_torrent,
+                cfg_seeder_max_peers_per_ip;
+
+// If nonzero, peers may also connect with uTP (BEP 29), over UDP on the
+// seeder's port.
+extern unsigned cfg_utp;
+
+// Length of the queue of pending connections on listening sockets.
+extern unsigned cfg_listen_backlog;
+
+// Number of seconds after which connections are closed if peers have not
+// completed their handshake, or have not sent anything (0 for no limit).
+extern unsigned cfg_handshake_timeout, cfg_peer_timeout;
+
+// Number of seconds after which a keep-alive message is sent to a peer if
+// nothing else was sent (0 to disable).
+extern unsigned cfg_keep_alive_interval;
+
+// Number of seconds after which HTTP connections to the tracker are closed
+// if no request has been handled and no data has been sent (0 for no limit).
+extern unsigned cfg_http_timeout;
+
+// Number of seconds after which idle persistent HTTP connections are closed
+// (0 for no limit).
+extern unsigned cfg_http_idle_timeout;
+
+// Maximum number of requests handled per HTTP connection (0 for no limit).
+extern unsigned cfg_http_max_requests;
+
 // Interval at which peers should contact the tracker, in seconds.
 extern unsigned cfg_tracker_rerequest_interval;
 
@@ -52,6 +158,10 @@ extern unsigned cfg_tracker_purge_interval;
 // peers will be purged on a first-in-first-out basis to make room for new peers.
 extern unsigned cfg_tracker_max_peers_per_torrent;
 
+// Number of seconds for which the reply to a scrape of all torrents is
+// cached (0 to build it for every request).
+extern unsigned cfg_tracker_scrape_interval;
+
 
 bool load_config(const char *filepath);
 
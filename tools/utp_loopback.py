@@ -0,0 +1,239 @@
+#!/usr/bin/env python3
+#
+# End-to-end check of the seeder's uTP (BEP 29) support over loopback.
+#
+# Connects to a running geyser over uTP, downloads every piece of the given
+# torrents with the BitTorrent peer protocol, and checks each piece against
+# its SHA-1 hash. With --loss, that fraction of received data packets is
+# dropped, to exercise retransmission and reordering.
+#
+# Usage:
+#   python3 tools/utp_loopback.py [--host HOST] [--loss FRACTION] \
+#       SEEDER_PORT TORRENT...
+#
+# For example, with utp = 1 and seeder_port_min = 6881 in geyser.conf:
+#   python3 tools/utp_loopback.py 6881 metadata/*.torrent
+#   python3 tools/utp_loopback.py --loss 0.05 6881 metadata/*.torrent
+#
+# Prints the number of pieces verified per torrent, then OK. Exits with a
+# nonzero status on any error.
+
+import argparse, hashlib, os, random, select, socket, struct, sys, time
+
+ST_DATA, ST_FIN, ST_STATE, ST_RESET, ST_SYN = range(5)
+
+def timestamp():
+    return int(time.time()*1e6) & 0xffffffff
+
+class UtpStream:
+    """Minimal uTP initiator with a socket-like sendall()/recv() interface.
+    Outgoing data is resent until acknowledged; incoming data is acked per
+    packet and reassembled in order."""
+
+    def __init__(self, address, loss=0.0):
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.sock.connect(address)
+        self.loss = loss
+        self.recv_id = random.randint(0, 60000)
+        self.send_id = self.recv_id + 1
+        self.seq_nr, self.ack_nr = 1, 0
+        self.reply_delay = 0
+        self.buffer, self.out_of_order, self.unacked = b'', {}, {}
+        self.fin = self.connected = False
+        self.send_packet(ST_SYN, self.recv_id, b'')
+        self.seq_nr += 1
+        deadline = time.time() + 10
+        while not self.connected:
+            if time.time() > deadline:
+                raise Exception('connect timed out')
+            self.receive(1)
+
+    def send_packet(self, type, connection_id, payload, seq_nr=None):
+        header = struct.pack( '>BBHIIIHH', type << 4 | 1, 0, connection_id,
+            timestamp(), self.reply_delay, 1 << 20,
+            self.seq_nr if seq_nr is None else seq_nr, self.ack_nr )
+        self.sock.send(header + payload)
+
+    def receive(self, timeout):
+        """Handles one incoming packet; returns False on timeout."""
+        if not select.select([self.sock], [], [], timeout)[0]:
+            return False
+        packet = self.sock.recv(65536)
+        type = packet[0] >> 4
+        (connection_id, ts, ts_diff, wnd_size,
+         seq_nr, ack_nr) = struct.unpack('>HIIIHH', packet[2:20])
+        extension, offset = packet[1], 20
+        while extension:
+            extension = packet[offset]
+            offset += 2 + packet[offset + 1]
+        payload = packet[offset:]
+
+        self.reply_delay = (timestamp() - ts) & 0xffffffff
+        for seq in list(self.unacked):
+            if (ack_nr - seq) & 0xffff < 0x8000:
+                del self.unacked[seq]
+        if type == ST_RESET:
+            raise Exception('connection reset')
+        if type == ST_STATE and not self.connected:
+            self.connected = True
+            self.ack_nr = (seq_nr - 1) & 0xffff
+        elif type in (ST_DATA, ST_FIN):
+            if random.random() < self.loss:
+                return True
+            ahead = (seq_nr - self.ack_nr - 1) & 0xffff
+            if ahead == 0:
+                self.deliver(seq_nr, payload, type)
+                while (self.ack_nr + 1) & 0xffff in self.out_of_order:
+                    seq = (self.ack_nr + 1) & 0xffff
+                    self.deliver(seq, *self.out_of_order.pop(seq))
+            elif ahead < 0x8000:
+                self.out_of_order[seq_nr] = (payload, type)
+            self.send_packet(ST_STATE, self.send_id, b'')
+        return True
+
+    def deliver(self, seq_nr, payload, type):
+        self.buffer += payload
+        self.ack_nr = seq_nr
+        if type == ST_FIN:
+            self.fin = True
+
+    def sendall(self, data):
+        for pos in range(0, len(data), 1000):
+            chunk = data[pos:pos + 1000]
+            self.unacked[self.seq_nr] = chunk
+            self.send_packet(ST_DATA, self.send_id, chunk)
+            self.seq_nr = (self.seq_nr + 1) & 0xffff
+
+    def recv(self, size):
+        idle = 0
+        while not self.buffer and not self.fin:
+            if self.receive(1):
+                idle = 0
+                continue
+            idle += 1
+            if idle > 30:
+                raise Exception('no data received for 30 seconds')
+            for seq, chunk in list(self.unacked.items()):
+                self.send_packet(ST_DATA, self.send_id, chunk, seq)
+        data, self.buffer = self.buffer[:size], self.buffer[size:]
+        return data
+
+    def close(self):
+        self.send_packet(ST_FIN, self.send_id, b'')
+        self.sock.close()
+
+def bdecode(data, pos=0):
+    c = data[pos:pos + 1]
+    if c == b'i':
+        end = data.index(b'e', pos)
+        return int(data[pos + 1:end]), end + 1
+    if c in (b'l', b'd'):
+        pos += 1
+        items = []
+        while data[pos:pos + 1] != b'e':
+            item, pos = bdecode(data, pos)
+            items.append(item)
+        if c == b'd':
+            return dict(zip(items[::2], items[1::2])), pos + 1
+        return items, pos + 1
+    sep = data.index(b':', pos)
+    end = sep + 1 + int(data[pos:sep])
+    return data[sep + 1:end], end
+
+def bencode(value):
+    if isinstance(value, int):
+        return b'i%de' % value
+    if isinstance(value, bytes):
+        return b'%d:%s' % (len(value), value)
+    if isinstance(value, list):
+        return b'l' + b''.join(map(bencode, value)) + b'e'
+    return b'd' + b''.join( bencode(k) + bencode(value[k])
+                            for k in sorted(value) ) + b'e'
+
+def recv_exactly(stream, size):
+    data = b''
+    while len(data) < size:
+        chunk = stream.recv(size - len(data))
+        if not chunk:
+            raise Exception('connection closed')
+        data += chunk
+    return data
+
+def recv_message(stream):
+    length = struct.unpack('>I', recv_exactly(stream, 4))[0]
+    return recv_exactly(stream, length) if length else b''
+
+def download(path, address, loss, block_size=16384, pipeline=64):
+    info = bdecode(open(path, 'rb').read())[0][b'info']
+    info_hash = hashlib.sha1(bencode(info)).digest()
+    piece_length, hashes = info[b'piece length'], info[b'pieces']
+    if b'length' in info:
+        total = info[b'length']
+    else:
+        total = sum(f[b'length'] for f in info[b'files'])
+    pieces = (total + piece_length - 1)//piece_length
+
+    requests = []
+    for piece in range(pieces):
+        length = min(piece_length, total - piece*piece_length)
+        for begin in range(0, length, block_size):
+            requests.append((piece, begin, min(block_size, length - begin)))
+
+    stream = UtpStream(address, loss)
+    stream.sendall( b'\x13BitTorrent protocol' + b'\0'*8 + info_hash +
+                    b'-PY0001-' + os.urandom(12) )
+    if recv_exactly(stream, 68)[28:48] != info_hash:
+        raise Exception('handshake for wrong torrent')
+    stream.sendall(struct.pack('>IB', 1, 2))    # interested
+
+    blocks, todo, outstanding, unchoked = {}, requests[::-1], set(), False
+    while len(blocks) < len(requests):
+        while unchoked and todo and len(outstanding) < pipeline:
+            request = todo.pop()
+            outstanding.add(request)
+            stream.sendall(struct.pack('>IBIII', 13, 6, *request))
+        message = recv_message(stream)
+        if not message:
+            continue
+        if message[0] == 0:             # choke: requests are discarded
+            unchoked = False
+            todo.extend(sorted(outstanding, reverse=True))
+            outstanding.clear()
+        elif message[0] == 1:           # unchoke
+            unchoked = True
+        elif message[0] == 7:           # piece
+            piece, begin = struct.unpack('>II', message[1:9])
+            blocks[piece, begin] = message[9:]
+            outstanding.discard((piece, begin, len(message) - 9))
+        elif message[0] == 16:          # reject request (BEP 6)
+            request = struct.unpack('>III', message[1:13])
+            outstanding.discard(request)
+            todo.append(request)
+    stream.close()
+
+    for piece in range(pieces):
+        length = min(piece_length, total - piece*piece_length)
+        data = b''.join( blocks[piece, begin]
+                         for begin in range(0, length, block_size) )
+        if hashlib.sha1(data).digest() != hashes[20*piece:20*piece + 20]:
+            raise Exception('piece %d of %s does not match its hash' % (piece, path))
+    return pieces
+
+def main():
+    parser = argparse.ArgumentParser(description='uTP loopback download check')
+    parser.add_argument('--host', default='127.0.0.1')
+    parser.add_argument('--loss', type=float, default=0.0,
+                        help='fraction of received data packets to drop')
+    parser.add_argument('port', type=int)
+    parser.add_argument('torrents', nargs='+')
+    args = parser.parse_args()
+    for path in args.torrents:
+        pieces = download(path, (args.host, args.port), args.loss)
+        print('%s: %d pieces verified' % (path, pieces))
+    print('OK')
+
+if __name__ == '__main__':
+    try:
+        main()
+    except Exception as e:
+        sys.exit('FAILED: %s' % e)